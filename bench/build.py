@@ -0,0 +1,426 @@
+#!/usr/bin/env python3
+"""
+build - Benchmark whole builds of a Win32 project through the XWin wrappers
+
+Generates a C++ project of N translation units that include windows.h and
+other SDK headers, and afxwin.h when MFC was installed with the image, and
+link SDK import libraries, in two variants: one spelling every include, library
+and link directory in a case that doesn't exist on disk, as Windows sources
+do, and one spelling them exactly as they are on disk. Each variant has a
+Makefile, a build.ninja and a CMakeLists.txt, and is built from scratch with
+the make, ninja and cmake wrappers with MSYSTEM=XWIN:
+
+  baseline  the exact variant, with nothing preloaded (INSENSITIVE_LIBRARY=)
+  exact     the exact variant, with the library preloaded
+  miscased  the miscased variant, with the library preloaded
+
+For each build it reports the wall time and the CPU time of all processes,
+both the median of the repeats, and the syscalls and failed syscalls of one
+more build under strace -f -c, with the overhead of the two preloaded builds
+over the baseline. It runs offline inside the image, as /opt/xwin is all it
+needs.
+"""
+
+import argparse
+import json
+import os
+import random
+import resource
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+
+# SDK headers, the import library each needs and a call into it
+HEADERS = [
+    ('windows.h', 'kernel32.lib', '(int)GetCurrentProcessId()'),
+    ('windows.h', 'user32.lib', 'GetSystemMetrics(SM_CXSCREEN)'),
+    ('windows.h', 'gdi32.lib', '(GetStockObject(WHITE_BRUSH) != NULL)'),
+    ('windows.h', 'advapi32.lib', '(int)RegCloseKey(HKEY_CURRENT_USER)'),
+    ('commctrl.h', 'comctl32.lib', '(InitCommonControls(), 1)'),
+    ('shellapi.h', 'shell32.lib', '(int)(INT_PTR)ShellExecuteA(NULL, NULL, NULL, NULL, NULL, SW_HIDE)'),
+    ('shlwapi.h', 'shlwapi.lib', 'PathFileExistsA("C:\\\\")'),
+    ('objbase.h', 'ole32.lib', '(CoInitialize(NULL) >= 0)'),
+    ('psapi.h', 'psapi.lib', '(int)EmptyWorkingSet(GetCurrentProcess())'),
+]
+
+# Directories the cc and c++ wrappers add to the include path, and those of
+# the import libraries, relative to the xwin root
+INCLUDE_DIRS = ['crt/include', 'sdk/include/ucrt', 'sdk/include/um', 'sdk/include/shared']
+LIBRARY_DIRS = ['sdk/lib/um/x86_64', 'crt/lib/x86_64', 'sdk/lib/ucrt/x86_64']
+
+# Every nth unit includes afxwin.h instead of the SDK headers, since MFC
+# refuses to be included after windows.h
+MFC_EVERY = 16
+
+CONFIGS = ['baseline', 'exact', 'miscased']
+SYSTEMS = ['make', 'ninja', 'cmake']
+
+
+def real_path(root, relative):
+    """The path of `relative` under `root` in the case it has on disk, or None"""
+    path = root
+    for part in relative.split('/'):
+        if os.path.exists(os.path.join(path, part)):
+            path = os.path.join(path, part)
+            continue
+        try:
+            matches = sorted(n for n in os.listdir(path) if n.lower() == part.lower())
+        except OSError:
+            return None
+        if not matches:
+            return None
+        path = os.path.join(path, matches[0])
+    return path
+
+
+def miscase(name, exists, rng):
+    """A spelling of `name` in another case for which `exists` is false"""
+    candidates = [name.upper(), name.capitalize(), name.swapcase()]
+    for _ in range(64):
+        candidates.append(''.join(c.swapcase() if rng.random() < 0.5 else c for c in name))
+    for candidate in candidates:
+        if candidate != name and not exists(candidate):
+            return candidate
+    return None
+
+
+def find(dirs, name):
+    """The first of `dirs` that has `name` in any case, with the name as on disk"""
+    for d in dirs:
+        path = real_path(d, name)
+        if path:
+            return d, os.path.basename(path)
+    return None, None
+
+
+class Project:
+    """Names of the headers, libraries and link directories of the project as
+    they are on disk, and misspelled in case"""
+
+    def __init__(self, xwin, mfc, rng):
+        self.include_dirs = [p for p in (real_path(xwin, d) for d in INCLUDE_DIRS) if p]
+        self.library_dirs = [p for p in (real_path(xwin, d) for d in LIBRARY_DIRS) if p]
+        if not self.include_dirs or not self.library_dirs:
+            raise SystemExit(f'build: no SDK headers or libraries under {xwin}')
+
+        def header_exists(name):
+            return any(os.path.exists(os.path.join(d, name)) for d in self.include_dirs)
+
+        def library_exists(name):
+            return any(os.path.exists(os.path.join(d, name)) for d in self.library_dirs)
+
+        # The same name always gets the same misspelling
+        headers, libraries = {}, {}
+        self.apis = []
+        for header, library, call in HEADERS:
+            if header not in headers:
+                directory, real = find(self.include_dirs, header)
+                headers[header] = (real, miscase(real, header_exists, rng)) if real else None
+            if library not in libraries:
+                directory, real = find(self.library_dirs, library)
+                libraries[library] = (real, miscase(real, library_exists, rng)) if real else None
+            if not headers[header] or not libraries[library]:
+                print(f'build: {header} or {library} is missing, leaving out {call}', file=sys.stderr)
+                continue
+            self.apis.append((headers[header], libraries[library], call))
+        self.windows = headers.get('windows.h')
+        if not self.windows:
+            raise SystemExit(f'build: no windows.h under {xwin}')
+        self.libraries = sorted(set(library for _, library, _ in self.apis))
+
+        # The link directories are misspelled below the xwin root only, so
+        # that the library resolves them the way it does the SDK trees
+        self.link_dirs = []
+        for d in self.library_dirs:
+            relative = os.path.relpath(d, xwin)
+            spelled = miscase(relative, lambda p: os.path.exists(os.path.join(xwin, p)), rng)
+            self.link_dirs.append((d, os.path.join(xwin, spelled) if spelled else d))
+
+        # MFC is only there if the image was built with INCLUDE_MFC
+        self.mfc = None
+        if mfc != 'never':
+            afxwin = real_path(xwin, 'crt/atlmfc/include/afxwin.h') or self._search(xwin, 'afxwin.h')
+            if afxwin:
+                directory = os.path.dirname(afxwin)
+                name = os.path.basename(afxwin)
+                self.mfc = (directory, (name, miscase(name, lambda n: os.path.exists(os.path.join(directory, n)),
+                                                      rng)))
+            elif mfc == 'always':
+                raise SystemExit(f'build: no afxwin.h under {xwin}, build the image with INCLUDE_MFC')
+
+    @staticmethod
+    def _search(root, name):
+        for directory, _, files in os.walk(root):
+            for f in files:
+                if f.lower() == name:
+                    return os.path.join(directory, f)
+        return None
+
+
+def spelled(names, miscased):
+    """The name on disk, or its misspelling in the miscased variant"""
+    real, wrong = names
+    return wrong if miscased and wrong else real
+
+
+def generate(project, root, units, miscased):
+    """Write the sources and build files of a variant to `root`"""
+    src = root / 'src'
+    src.mkdir(parents=True)
+    common = 'COMMON.H' if miscased else 'Common.h'
+    (src / 'Common.h').write_text('#pragma once\n\n'
+                                  'static inline int common_mix(int unit, int value) {\n'
+                                  '    return unit * 31 + value;\n'
+                                  '}\n')
+    sources = []
+    for unit in range(units):
+        lines = []
+        if project.mfc and unit % MFC_EVERY == MFC_EVERY - 1:
+            lines.append(f'#include <{spelled(project.mfc[1], miscased)}>')
+            body = '    CString name(_T("unit"));\n    return common_mix(%d, name.GetLength());\n' % unit
+        else:
+            # A few APIs per unit, each with its header and library
+            apis = [project.apis[(unit + i * 3) % len(project.apis)] for i in range(3)]
+            included = [project.windows]
+            for header, _, _ in apis:
+                if header not in included:
+                    included.append(header)
+            lines += [f'#include <{spelled(h, miscased)}>' for h in included]
+            # Libraries are also named in the sources, as Windows code does
+            _, library, _ = apis[0]
+            lines.append(f'#pragma comment(lib, "{spelled(library, miscased)}")')
+            body = '    int value = 0;\n'
+            body += ''.join(f'    value += {call};\n' for _, _, call in apis)
+            body += f'    return common_mix({unit}, value);\n'
+        lines.append(f'#include "{common}"')
+        name = f'unit_{unit:04d}.cpp'
+        (src / name).write_text('\n'.join(lines) + f'\n\nint unit_{unit:04d}(void) {{\n{body}}}\n')
+        sources.append(name)
+
+    declarations = ''.join(f'int unit_{unit:04d}(void);\n' for unit in range(units))
+    calls = ''.join(f'    sum += unit_{unit:04d}();\n' for unit in range(units))
+    (src / 'main.cpp').write_text(f'{declarations}\nint main() {{\n    int sum = 0;\n{calls}    return sum & 1;\n}}\n')
+    sources.append('main.cpp')
+
+    include_flags = f' -I{project.mfc[0]}' if project.mfc else ''
+    cxxflags = f'-O1 -fexceptions{include_flags}'
+    link_dirs = [spelled(d, miscased) for d in project.link_dirs]
+    ldflags = '-fuse-ld=lld ' + ' '.join(f'-L{d}' for d in link_dirs)
+    libraries = [spelled(library, miscased) for library in project.libraries]
+    ldlibs = ' '.join(f'-l{library}' for library in libraries)
+    objects = [f'out/{Path(s).stem}.o' for s in sources]
+
+    # The compilers are the wrappers in PATH
+    with open(root / 'Makefile', 'w') as f:
+        f.write('# Generated by bench/build.py\n'
+                'CXX = c++\n'
+                f'CXXFLAGS = {cxxflags}\n'
+                f'LDFLAGS = {ldflags}\n'
+                f'LDLIBS = {ldlibs}\n'
+                f'OBJECTS = {" ".join(objects)}\n\n'
+                'out/app.exe: $(OBJECTS)\n'
+                '\t$(CXX) $(LDFLAGS) $(OBJECTS) -o $@ $(LDLIBS)\n\n'
+                'out/%.o: src/%.cpp src/Common.h | out\n'
+                '\t$(CXX) $(CXXFLAGS) -c $< -o $@\n\n'
+                'out:\n'
+                '\tmkdir -p out\n')
+
+    with open(root / 'build.ninja', 'w') as f:
+        f.write('# Generated by bench/build.py\n'
+                f'cxxflags = {cxxflags}\n'
+                f'ldflags = {ldflags}\n'
+                f'ldlibs = {ldlibs}\n\n'
+                'rule cxx\n'
+                '  command = c++ $cxxflags -c $in -o $out\n\n'
+                'rule link\n'
+                '  command = c++ $ldflags $in -o $out $ldlibs\n\n')
+        for s, o in zip(sources, objects):
+            f.write(f'build {o}: cxx src/{s} | src/Common.h\n')
+        f.write(f'\nbuild out/app.exe: link {" ".join(objects)}\n\ndefault out/app.exe\n')
+
+    with open(root / 'CMakeLists.txt', 'w') as f:
+        f.write('# Generated by bench/build.py\n'
+                'cmake_minimum_required(VERSION 3.20)\n'
+                'project(win32_bench CXX)\n\n'
+                'add_executable(app\n' + ''.join(f'    src/{s}\n' for s in sources) + ')\n'
+                f'target_compile_options(app PRIVATE {cxxflags})\n'
+                'target_link_options(app PRIVATE -fuse-ld=lld)\n'
+                'target_link_directories(app PRIVATE\n' + ''.join(f'    {d}\n' for d in link_dirs) + ')\n'
+                'target_link_libraries(app PRIVATE\n' + ''.join(f'    {l}\n' for l in libraries) + ')\n')
+
+
+def commands(system, jobs):
+    """The commands of a build from scratch in the project directory"""
+    if system == 'make':
+        return [['make', f'-j{jobs}']]
+    if system == 'ninja':
+        return [['ninja', f'-j{jobs}']]
+    return [['cmake', '-S', '.', '-B', 'cmake-build'], ['cmake', '--build', 'cmake-build', '-j', str(jobs)]]
+
+
+def clean(root):
+    for output in ('out', 'cmake-build', '.ninja_log', '.ninja_deps'):
+        path = root / output
+        if path.is_dir():
+            shutil.rmtree(path)
+        elif path.exists():
+            path.unlink()
+
+
+def build(root, system, jobs, env, log, strace=None):
+    """Build from scratch and return its wall and CPU seconds, under strace
+    -f -c writing to `strace` files if given"""
+    clean(root)
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.monotonic()
+    with open(log, 'w') as output:
+        for i, command in enumerate(commands(system, jobs)):
+            if strace:
+                command = ['strace', '-f', '-c', '-o', f'{strace}.{i}', '--'] + command
+            if subprocess.run(command, cwd=root, env=env, stdout=output, stderr=subprocess.STDOUT).returncode:
+                with open(log) as lines:
+                    tail = lines.readlines()[-20:]
+                raise SystemExit(f'build: {" ".join(command)} failed in {root}, the end of {log}:\n' + ''.join(tail))
+    wall = time.monotonic() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    cpu = (after.ru_utime - before.ru_utime) + (after.ru_stime - before.ru_stime)
+    return wall, cpu
+
+
+def syscalls(files):
+    """Calls and failures per syscall from strace -c summaries"""
+    counts = {}
+    for path in files:
+        with open(path) as f:
+            for line in f:
+                fields = line.split()
+                # % time, seconds, usecs/call, calls, [errors,] syscall
+                if len(fields) not in (5, 6) or not fields[3].isdigit() or fields[-1] == 'total':
+                    continue
+                calls, errors = counts.get(fields[-1], (0, 0))
+                counts[fields[-1]] = (calls + int(fields[3]), errors + (int(fields[4]) if len(fields) == 6 else 0))
+    return counts
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark whole builds of a Win32 project through the XWin wrappers',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog='''
+Examples:
+  bench/build.py
+  bench/build.py --units 500 --repeats 5 --systems ninja -o results
+  bench/build.py --library /tmp/libinsensitive.so --no-strace
+''')
+    parser.add_argument('-o', '--output', default='build-results',
+                        help='Directory for build.json and the build logs (default: build-results)')
+    parser.add_argument('--units', type=int, default=200, help='Translation units of the project (default: 200)')
+    parser.add_argument('--repeats', type=int, default=3, help='Timed builds of each kind (default: 3)')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(), help='Parallel jobs (default: all CPUs)')
+    parser.add_argument('--systems', default=','.join(SYSTEMS),
+                        help='Comma-separated build systems among make, ninja and cmake (default: all)')
+    parser.add_argument('--mfc', choices=['auto', 'always', 'never'], default='auto',
+                        help='Include afxwin.h in some units: if installed, always or never (default: auto)')
+    parser.add_argument('--library', help='Build of libinsensitive.so to preload (default: that of the wrappers)')
+    parser.add_argument('--xwin', default='/opt/xwin', help='Root of the SDK (default: /opt/xwin)')
+    parser.add_argument('--no-strace', action='store_true', help='Skip the builds that count syscalls')
+    parser.add_argument('--keep', action='store_true', help='Keep the generated projects')
+    parser.add_argument('--seed', type=int, default=1, help='Random seed of the misspellings')
+    args = parser.parse_args()
+
+    systems = args.systems.split(',')
+    if any(s not in SYSTEMS for s in systems) or args.units < 1 or args.repeats < 1:
+        parser.error('unknown build system, or no units or repeats')
+    # The wrappers are installed over the real tools, which they call as *.orig
+    for system in ['cc', 'c++'] + systems:
+        if not os.path.exists(f'/usr/bin/{system}.orig'):
+            raise SystemExit(f'build: /usr/bin/{system}.orig not found, run this inside the clang-xwin image')
+    strace = not args.no_strace and shutil.which('strace')
+    if not strace and not args.no_strace:
+        print('build: strace not found, not counting syscalls', file=sys.stderr)
+
+    project = Project(args.xwin, args.mfc, random.Random(args.seed))
+    out = Path(args.output)
+    out.mkdir(parents=True, exist_ok=True)
+    work = Path(tempfile.mkdtemp(prefix='insensitive-build-'))
+    try:
+        for variant in ('exact', 'miscased'):
+            generate(project, work / variant, args.units, variant == 'miscased')
+
+        # Only the settings of each configuration apply, not those of the
+        # environment or of the wrappers that started this script
+        env = {k: v for k, v in os.environ.items()
+               if k not in ('LD_PRELOAD', 'LDFLAGS', 'CXXFLAGS', 'MAKEFLAGS') and not k.startswith('INSENSITIVE_')}
+        env['MSYSTEM'] = 'XWIN'
+        if args.library:
+            env['INSENSITIVE_LIBRARY'] = os.path.abspath(args.library)
+        environments = {
+            'baseline': dict(env, INSENSITIVE_LIBRARY=''),
+            'exact': env,
+            'miscased': env,
+        }
+
+        results = []
+        print(f'{"system":<7} {"config":<9} {"wall s":>8} {"cpu s":>8} {"syscalls":>10} {"failed":>9} '
+              f'{"wall":>8} {"cpu":>8}')
+        for system in systems:
+            baseline = None
+            for config in CONFIGS:
+                root = work / ('miscased' if config == 'miscased' else 'exact')
+                log = out / f'{system}-{config}.log'
+                times = [build(root, system, args.jobs, environments[config], log) for _ in range(args.repeats)]
+                result = {
+                    'system': system,
+                    'config': config,
+                    'wall_s': statistics.median(t[0] for t in times),
+                    'cpu_s': statistics.median(t[1] for t in times),
+                    'runs': [{'wall_s': wall, 'cpu_s': cpu} for wall, cpu in times],
+                }
+                if strace:
+                    summary = out / f'{system}-{config}.strace'
+                    build(root, system, args.jobs, environments[config], log, summary)
+                    parts = sorted(out.glob(f'{summary.name}.*'))
+                    counts = syscalls(parts)
+                    for part in parts:
+                        part.unlink()
+                    result['syscalls'] = sum(c for c, _ in counts.values())
+                    result['failed_syscalls'] = sum(e for _, e in counts.values())
+                    result['by_syscall'] = {name: {'calls': c, 'failed': e} for name, (c, e) in sorted(counts.items())}
+                if baseline is None:
+                    baseline = result
+                else:
+                    result['wall_overhead'] = result['wall_s'] / baseline['wall_s'] - 1
+                    result['cpu_overhead'] = result['cpu_s'] / baseline['cpu_s'] - 1
+                results.append(result)
+
+                def overhead(key):
+                    return f'{100 * result[key]:+7.1f}%' if key in result else f'{"":>8}'
+                print(f'{system:<7} {config:<9} {result["wall_s"]:>8.2f} {result["cpu_s"]:>8.2f} '
+                      f'{result.get("syscalls", ""):>10} {result.get("failed_syscalls", ""):>9} '
+                      f'{overhead("wall_overhead")} {overhead("cpu_overhead")}')
+
+        with open(out / 'build.json', 'w') as f:
+            json.dump({
+                'units': args.units,
+                'mfc_units': len(range(MFC_EVERY - 1, args.units, MFC_EVERY)) if project.mfc else 0,
+                'jobs': args.jobs,
+                'repeats': args.repeats,
+                'library': args.library or 'default',
+                'results': results,
+            }, f, indent=2)
+            f.write('\n')
+        if args.keep:
+            print(f'build: projects kept in {work}')
+    finally:
+        if not args.keep:
+            shutil.rmtree(work, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
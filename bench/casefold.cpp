@@ -0,0 +1,159 @@
+// Measure the case folding kernels of casefold.h on names and paths like those
+// of the SDK, against the byte-at-a-time folding they replaced, and check that
+// every kernel folds, compares and hashes exactly like the scalar one:
+//
+// clang++ -O2 -std=c++20 -I. bench/casefold.cpp -o casefold
+// ./casefold [iterations]
+
+#include "casefold.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace casefold_detail;
+
+// The folding used before the kernels: ASCII only, one byte at a time
+static bool bytewise_equals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (fold_char(a[i]) != fold_char(b[i])) return false;
+    }
+    return true;
+}
+
+static uint64_t bytewise_hash(std::string_view s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (char c : s) {
+        h ^= static_cast<unsigned char>(fold_char(c));
+        h *= 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+static std::string random_case(std::string s, std::mt19937& rng) {
+    for (char& c : s) {
+        if (c >= 'a' && c <= 'z' && rng() % 2) c -= 'a' - 'A';
+    }
+    return s;
+}
+
+// Pairs of equal names in different case, and the same names each paired with
+// a name that differs in one letter
+struct Workload {
+    const char* name;
+    std::vector<std::string> a, b, different;
+};
+
+static Workload make_workload(const char* name, const std::vector<std::string>& samples, std::mt19937& rng) {
+    Workload w{name, {}, {}, {}};
+    for (int i = 0; i < 1024; i++) {
+        const std::string& s = samples[i % samples.size()];
+        w.a.push_back(random_case(s, rng));
+        w.b.push_back(random_case(s, rng));
+        std::string d = w.b.back();
+        d[d.size() - 3] ^= 0x01;
+        w.different.push_back(d);
+    }
+    return w;
+}
+
+template<typename F>
+static void measure(const char* what, const char* kernel, const Workload& w, long iterations, F&& f) {
+    volatile uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) sink = sink + f(i % w.a.size());
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-10s %-16s %-10s %10.2f\n", w.name, what, kernel, ns);
+}
+
+static bool check(const std::vector<const Kernels*>& all, std::mt19937& rng) {
+    // Random strings of ASCII letters and punctuation mixed with UTF-8
+    // characters and stray bytes, at all lengths around the vector widths
+    static const char* pieces[] = {"a", "Z", "_", ".", "/", "0", "\xc3\xa4", "\xc3\x84", "\xd0\xb6", "\xd0\x96",
+                                   "\xe1\xba\xa1", "\xe1\xba\xa0", "\xef\xbd\x81", "\xef\xbc\xa1", "\xff", "\xc3"};
+    for (int round = 0; round < 200000; round++) {
+        std::string a, b;
+        size_t length = rng() % 80;
+        while (a.size() < length) {
+            int piece = rng() % (round % 2 ? 6 : 16);
+            a += pieces[piece];
+            // The same character in the other case for letters, or the same piece
+            b += pieces[piece < 6 || piece >= 14 || rng() % 2 ? piece : piece ^ 1];
+        }
+        if (rng() % 4 == 0 && !b.empty()) b[rng() % b.size()] ^= 0x20;
+
+        bool equal = fold_equals(a, b, scalar_kernels);
+        uint64_t hash = fold_hash(a, scalar_kernels);
+        std::string folded = fold_string(a, scalar_kernels);
+        if (equal != (folded == fold_string(b, scalar_kernels)) ||
+            (equal && hash != fold_hash(b, scalar_kernels)) || fold_hash(folded, scalar_kernels) != hash) {
+            fprintf(stderr, "casefold: scalar kernels disagree on '%s' and '%s'\n", a.c_str(), b.c_str());
+            return false;
+        }
+        for (const Kernels* k : all) {
+            if (fold_equals(a, b, *k) != equal || fold_hash(a, *k) != hash || fold_string(a, *k) != folded) {
+                fprintf(stderr, "casefold: %s kernels disagree on '%s' and '%s'\n", k->name, a.c_str(), b.c_str());
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+    std::mt19937 rng(42);
+
+    std::vector<const Kernels*> all{&scalar_kernels};
+#ifdef CASEFOLD_X86_64
+    all.push_back(&sse2_kernels);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) all.push_back(&avx2_kernels);
+#endif
+    if (!check(all, rng)) return EXIT_FAILURE;
+    printf("kernels checked: ");
+    for (const Kernels* k : all) printf("%s ", k->name);
+    printf("(selected %s)\n\n", kernels().name);
+
+    std::vector<Workload> workloads{
+        make_workload("names", {"windows.h", "winnt.h", "basetsd.h", "kernel32.lib", "ucrt.lib",
+                                "d3d12.h", "stdio.h", "vcruntime.h", "sal.h", "specstrings_strict.h"}, rng),
+        make_workload("paths", {"/opt/xwin/sdk/include/10.0.22621/um/windows.h",
+                                "/opt/xwin/sdk/include/10.0.22621/shared/winapifamily.h",
+                                "/opt/xwin/crt/include/vcruntime_new.h",
+                                "/opt/xwin/sdk/lib/10.0.22621/um/x86_64/kernel32.lib"}, rng),
+        make_workload("utf-8", {"\xd0\xbf\xd1\x80\xd0\xb8\xd0\xbc\xd0\xb5\xd1\x80.h",
+                                "gr\xc3\xb6\xc3\x9f" "e.txt", "caf\xc3\xa9/men\xc3\xbc.h"}, rng),
+    };
+
+    printf("%-10s %-16s %-10s %10s\n", "workload", "operation", "kernel", "ns/call");
+    for (const Workload& w : workloads) {
+        measure("equals", "bytewise", w, iterations, [&](size_t i) { return bytewise_equals(w.a[i], w.b[i]); });
+        for (const Kernels* k : all) {
+            measure("equals", k->name, w, iterations, [&](size_t i) { return fold_equals(w.a[i], w.b[i], *k); });
+        }
+        measure("not equals", "bytewise", w, iterations,
+                [&](size_t i) { return bytewise_equals(w.a[i], w.different[i]); });
+        for (const Kernels* k : all) {
+            measure("not equals", k->name, w, iterations,
+                    [&](size_t i) { return fold_equals(w.a[i], w.different[i], *k); });
+        }
+        measure("hash", "bytewise", w, iterations, [&](size_t i) { return bytewise_hash(w.a[i]); });
+        for (const Kernels* k : all) {
+            measure("hash", k->name, w, iterations, [&](size_t i) { return fold_hash(w.a[i], *k); });
+        }
+        for (const Kernels* k : all) {
+            measure("fold", k->name, w, iterations / 4,
+                    [&](size_t i) { return fold_string(w.a[i], *k).size(); });
+        }
+    }
+    return EXIT_SUCCESS;
+}
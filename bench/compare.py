@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""
+compare - Compare two sets of results of bench/run.sh
+
+Prints the time per call of every entry point and scenario before and after,
+and exits with 1 if any got slower by more than the threshold, so that a
+regression stands out in review.
+"""
+
+import argparse
+import json
+import sys
+from pathlib import Path
+
+
+def load(path):
+    """Results by run, function and scenario, from a directory or a single file"""
+    path = Path(path)
+    files = sorted(path.glob('*.json')) if path.is_dir() else [path]
+    results = {}
+    for f in files:
+        with open(f) as data:
+            for r in json.load(data)['results']:
+                results[(f.stem, r['function'], r['scenario'])] = r
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Compare two sets of results of bench/run.sh',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog='''
+Examples:
+  bench/compare.py results-main results-branch
+  bench/compare.py --threshold 5 results-main/preload.json results-branch/preload.json
+''')
+    parser.add_argument('before', help='Directory or file with the results before')
+    parser.add_argument('after', help='Directory or file with the results after')
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='Slowdown in percent that counts as a regression (default: 10)')
+    args = parser.parse_args()
+
+    before = load(args.before)
+    after = load(args.after)
+    regressions = 0
+    print(f'{"run":<14} {"function":<10} {"scenario":<14} {"before":>10} {"after":>10} {"change":>8}')
+    for key in sorted(before.keys() & after.keys()):
+        old = before[key]['ns_per_call']
+        new = after[key]['ns_per_call']
+        change = 100.0 * (new - old) / old if old else 0.0
+        mark = ''
+        if change > args.threshold:
+            mark = '  slower'
+            regressions += 1
+        if after[key]['failures'] != before[key]['failures']:
+            mark += f'  failures {before[key]["failures"]} -> {after[key]["failures"]}'
+        print(f'{key[0]:<14} {key[1]:<10} {key[2]:<14} {old:>10.1f} {new:>10.1f} {change:>+7.1f}%{mark}')
+    for key in sorted(before.keys() ^ after.keys()):
+        print(f'{key[0]:<14} {key[1]:<10} {key[2]:<14} only {"before" if key in before else "after"}')
+
+    if regressions:
+        print(f'\n{regressions} results slower by more than {args.threshold:g}%')
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,140 @@
+// Measure how lookups of cached case-insensitive matches scale with the
+// number of threads, and check that every thread keeps getting the right
+// real path while another thread adds entries to the caches meanwhile:
+//
+// clang++ -O2 -std=c++20 bench/concurrent_cache.cpp -o concurrent_cache
+// LD_PRELOAD=./libinsensitive.so ./concurrent_cache [max threads] [milliseconds per run]
+//
+// Lookups go through insensitive_resolve() rather than an intercepted call,
+// so that the syscall of the call doesn't hide the cost of the caches.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using Resolve = const char* (*)(int dirfd, const char* path, int flags);
+
+static constexpr int file_count = 512;
+
+struct Tree {
+    std::string root;
+    std::vector<std::string> miscased;
+    std::vector<std::string> real;
+};
+
+static std::string upcase(std::string s) {
+    for (char& c : s) {
+        if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+    }
+    return s;
+}
+
+static void create(const std::string& path) {
+    close(open(path.c_str(), O_CREAT | O_WRONLY, 0644));
+}
+
+// Run `threads` readers for `milliseconds` and return the lookups per second.
+// With `churn`, one more thread creates new files and resolves them, which
+// adds entries to the caches while the readers run
+static double run(Resolve resolve, const Tree& tree, int threads, int milliseconds, bool churn,
+                  std::atomic<bool>& wrong) {
+    std::atomic<bool> stop{false};
+    std::atomic<unsigned long> total{0};
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            unsigned long calls = 0;
+            for (size_t i = t * 37; !stop.load(std::memory_order_relaxed); i++) {
+                size_t n = i % tree.miscased.size();
+                const char* resolved = resolve(AT_FDCWD, tree.miscased[n].c_str(), 1);
+                if (strcmp(resolved, tree.real[n].c_str()) != 0) wrong = true;
+                calls++;
+            }
+            total += calls;
+        });
+    }
+
+    std::thread writer;
+    if (churn) {
+        writer = std::thread([&] {
+            for (int i = 0; !stop.load(std::memory_order_relaxed); i++) {
+                std::string name = "/churn" + std::to_string(i) + ".h";
+                create(tree.root + name);
+                resolve(AT_FDCWD, (tree.root + upcase(name)).c_str(), 1);
+                unlink((tree.root + name).c_str());
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+    stop = true;
+    for (std::thread& worker : workers) worker.join();
+    if (churn) writer.join();
+    return total.load() * 1000.0 / milliseconds;
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    int milliseconds = argc > 2 ? atoi(argv[2]) : 1000;
+    if (max_threads < 1) max_threads = 1;
+
+    Resolve resolve = reinterpret_cast<Resolve>(dlsym(RTLD_DEFAULT, "insensitive_resolve"));
+    if (!resolve) {
+        fprintf(stderr, "concurrent_cache: insensitive_resolve not found, preload libinsensitive.so\n");
+        return EXIT_FAILURE;
+    }
+
+    char root[] = "/tmp/insensitive-bench-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    Tree tree;
+    tree.root = root;
+    mkdir((tree.root + "/include").c_str(), 0755);
+    for (int i = 0; i < file_count; i++) {
+        std::string name = "/include/header" + std::to_string(i) + ".h";
+        create(tree.root + name);
+        tree.real.push_back(tree.root + name);
+        tree.miscased.push_back(tree.root + upcase(name));
+    }
+
+    // Warm up the caches with every path
+    for (int i = 0; i < file_count; i++) {
+        if (strcmp(resolve(AT_FDCWD, tree.miscased[i].c_str(), 1), tree.real[i].c_str()) != 0) {
+            fprintf(stderr, "concurrent_cache: %s does not resolve\n", tree.miscased[i].c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::atomic<bool> wrong{false};
+    printf("%-8s %16s %10s %16s\n", "threads", "lookups/s", "speedup", "with churn");
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double rate = run(resolve, tree, threads, milliseconds, false, wrong);
+        double churned = run(resolve, tree, threads, milliseconds, true, wrong);
+        if (threads == 1) single = rate;
+        printf("%-8d %16.0f %10.2f %16.0f\n", threads, rate, rate / single, churned);
+        if (threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+    }
+
+    for (const std::string& path : tree.real) unlink(path.c_str());
+    rmdir((tree.root + "/include").c_str());
+    rmdir(root);
+
+    if (wrong) {
+        fprintf(stderr, "concurrent_cache: a lookup returned a wrong path\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
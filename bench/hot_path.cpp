@@ -0,0 +1,107 @@
+// Measure the cost per call and the heap allocations of the intercepted
+// functions when a lookup hits: exact paths, cached case-insensitive matches
+// and cached misses, plus prebuilt index hits if an indexed path is given.
+// Run it once with the library preloaded and once without for the baseline:
+//
+// clang++ -O2 -std=c++20 bench/hot_path.cpp -o hot_path
+// LD_PRELOAD=./libinsensitive.so ./hot_path [iterations] [miscased path under an indexed root]
+//
+// With INSENSITIVE_DEBUG=1 INSENSITIVE_DEBUG_LEVEL=4 and INSENSITIVE_DEBUG_FILE
+// set, the difference to a run without them is the cost of tracing.
+//
+// Allocations are counted by interposing malloc in this executable, which
+// also catches those made by the preloaded library.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static std::atomic<unsigned long> allocations{0};
+
+extern "C" void* malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+static void run(const char* name, long iterations, const std::function<bool()>& call) {
+    // Warm up the caches and check that the call behaves as expected
+    if (!call()) {
+        printf("%-24s %12s %14s\n", name, "failed", "-");
+        return;
+    }
+
+    unsigned long before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) call();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    unsigned long allocated = allocations.load() - before;
+
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-24s %12.1f %14.3f\n", name, ns, double(allocated) / iterations);
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    const char* indexed_path = argc > 2 ? argv[2] : nullptr;
+
+    char root[] = "/tmp/insensitive-bench-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    std::string dir = std::string(root) + "/Include/Sub";
+    std::string file = dir + "/Header.H";
+    mkdir((std::string(root) + "/Include").c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+    close(open(file.c_str(), O_CREAT | O_WRONLY, 0644));
+
+    std::string exact = file;
+    std::string miscased = std::string(root) + "/include/SUB/header.h";
+    std::string missing = std::string(root) + "/include/SUB/missing.h";
+    int dirfd = open((std::string(root) + "/Include").c_str(), O_RDONLY | O_DIRECTORY);
+
+    struct stat st;
+    printf("%-24s %12s %14s\n", "scenario", "ns/call", "mallocs/call");
+    run("stat exact", iterations, [&] { return stat(exact.c_str(), &st) == 0; });
+    run("stat cached match", iterations, [&] { return stat(miscased.c_str(), &st) == 0; });
+    run("stat cached miss", iterations, [&] { return stat(missing.c_str(), &st) != 0; });
+    run("access cached match", iterations, [&] { return access(miscased.c_str(), R_OK) == 0; });
+    run("fstatat cached match", iterations, [&] { return fstatat(dirfd, "sub/HEADER.h", &st, 0) == 0; });
+    run("open cached match", iterations, [&] {
+        int fd = open(miscased.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        close(fd);
+        return true;
+    });
+    if (indexed_path) {
+        run("stat index hit", iterations, [&] { return stat(indexed_path, &st) == 0; });
+    }
+
+    close(dirfd);
+    unlink(file.c_str());
+    rmdir(dir.c_str());
+    rmdir((std::string(root) + "/Include").c_str());
+    rmdir(root);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,253 @@
+// Measure every intercepted entry point on a tree shaped like /opt/xwin, made
+// by bench/sdk_tree.py, for each kind of lookup: paths that exist as given,
+// miscased paths found in the caches, miscased paths looked up for the first
+// time in a process, miscased paths deep in the tree looked up for the first
+// time, and paths that don't exist in any case. bench/run.sh builds and runs
+// it with and without the library:
+//
+// clang++ -O2 -std=c++20 bench/lookups.cpp -o lookups
+// LD_PRELOAD=./libinsensitive.so ./lookups [-n iterations] [-o results.json] tree
+//
+// Without the library, the miscased lookups use the real paths instead, so
+// that the results are the cost of the calls when the case is right. First
+// lookups are measured in a new process for each entry point, so that the
+// caches start empty like in a compiler starting up.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// An entry point, called with a path relative to the root of the tree
+struct EntryPoint {
+    const char* name;
+    bool directories; // takes directories rather than files
+    std::function<bool(const std::string& relative)> call;
+};
+
+struct Result {
+    const char* function;
+    const char* scenario;
+    double ns;
+    size_t calls;
+    size_t failures;
+};
+
+static std::string miscase(const std::string& path, std::mt19937& rng) {
+    std::string s;
+    // Retry until at least one letter differs
+    do {
+        s = path;
+        for (char& c : s) {
+            if (isalpha(static_cast<unsigned char>(c)) && rng() % 2) c ^= 0x20;
+        }
+    } while (s == path && std::any_of(path.begin(), path.end(), [](char c) { return isalpha(c); }));
+    return s;
+}
+
+static size_t depth(const std::string& path) {
+    return std::count(path.begin(), path.end(), '/');
+}
+
+// Call repeatedly over `paths`, after a first round that fills the caches
+static Result warm(const EntryPoint& e, const char* scenario, const std::vector<std::string>& paths, long iterations,
+                   bool expected) {
+    size_t failures = 0;
+    for (const std::string& p : paths) failures += e.call(p) != expected;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) e.call(paths[i % paths.size()]);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return {e.name, scenario, std::chrono::duration<double, std::nano>(elapsed).count() / iterations,
+            size_t(iterations), failures};
+}
+
+// Call once for each of `paths` in a new process, whose caches are empty
+static Result cold(const EntryPoint& e, const char* scenario, const std::vector<std::string>& paths) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) return {e.name, scenario, 0, 0, paths.size()};
+    pid_t child = fork();
+    if (child == 0) {
+        close(pipe_fds[0]);
+        size_t failures = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (const std::string& p : paths) failures += !e.call(p);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() / paths.size();
+        bool written = write(pipe_fds[1], &ns, sizeof(ns)) == sizeof(ns) &&
+                       write(pipe_fds[1], &failures, sizeof(failures)) == sizeof(failures);
+        _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(pipe_fds[1]);
+    double ns = 0;
+    size_t failures = paths.size();
+    if (read(pipe_fds[0], &ns, sizeof(ns)) != sizeof(ns) ||
+        read(pipe_fds[0], &failures, sizeof(failures)) != sizeof(failures)) {
+        failures = paths.size();
+    }
+    close(pipe_fds[0]);
+    if (child > 0) waitpid(child, nullptr, 0);
+    return {e.name, scenario, ns, paths.size(), failures};
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: lookups [-n iterations] [-o results.json] tree\n");
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = 200000;
+    const char* output = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:h")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atol(optarg); break;
+        case 'o': output = optarg; break;
+        default: usage(); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || iterations < 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    std::string root = argv[optind];
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+    bool preloaded = dlsym(RTLD_DEFAULT, "insensitive_resolve") != nullptr;
+
+    std::vector<std::string> files;
+    std::ifstream list(root + "/paths.txt");
+    for (std::string line; std::getline(list, line);) {
+        if (!line.empty()) files.push_back(line);
+    }
+    if (files.empty()) {
+        fprintf(stderr, "lookups: no %s/paths.txt, make the tree with bench/sdk_tree.py\n", root.c_str());
+        return EXIT_FAILURE;
+    }
+
+    int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        perror("lookups: open");
+        return EXIT_FAILURE;
+    }
+    auto absolute = [&](const std::string& relative) { return root + "/" + relative; };
+    std::vector<EntryPoint> entry_points = {
+        {"open", false, [&](const std::string& p) {
+            int fd = open(absolute(p).c_str(), O_RDONLY);
+            return fd >= 0 && close(fd) == 0;
+        }},
+        {"openat", false, [&](const std::string& p) {
+            int fd = openat(root_fd, p.c_str(), O_RDONLY);
+            return fd >= 0 && close(fd) == 0;
+        }},
+        {"stat", false, [&](const std::string& p) {
+            struct stat st;
+            return stat(absolute(p).c_str(), &st) == 0;
+        }},
+        {"lstat", false, [&](const std::string& p) {
+            struct stat st;
+            return lstat(absolute(p).c_str(), &st) == 0;
+        }},
+        {"fstatat", false, [&](const std::string& p) {
+            struct stat st;
+            return fstatat(root_fd, p.c_str(), &st, 0) == 0;
+        }},
+        {"statx", false, [&](const std::string& p) {
+            struct statx stx;
+            return statx(root_fd, p.c_str(), 0, STATX_BASIC_STATS, &stx) == 0;
+        }},
+        {"access", false, [&](const std::string& p) { return access(absolute(p).c_str(), R_OK) == 0; }},
+        {"faccessat", false, [&](const std::string& p) { return faccessat(root_fd, p.c_str(), R_OK, 0) == 0; }},
+        {"opendir", true, [&](const std::string& p) {
+            DIR* d = opendir(absolute(p).c_str());
+            return d && closedir(d) == 0;
+        }},
+    };
+
+    // The same samples for every entry point and run
+    std::mt19937 rng(42);
+    std::vector<std::string> shuffled = files;
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    std::vector<std::string> directories;
+    for (const std::string& f : files) {
+        std::string d = f.substr(0, f.rfind('/'));
+        if (std::find(directories.begin(), directories.end(), d) == directories.end()) directories.push_back(d);
+    }
+    std::vector<std::string> deep;
+    size_t max_depth = 0;
+    for (const std::string& f : shuffled) max_depth = std::max(max_depth, depth(f));
+    for (const std::string& f : shuffled) {
+        if (depth(f) + 2 >= max_depth) deep.push_back(f);
+    }
+
+    struct Samples {
+        std::vector<std::string> exact, miscased, cold, deep, missing;
+    };
+    auto make_samples = [&](const std::vector<std::string>& from, const std::vector<std::string>& deep_from) {
+        Samples s;
+        size_t hot = std::min<size_t>(from.size(), 1024);
+        size_t first = std::min<size_t>(from.size(), 4096);
+        s.exact.assign(from.begin(), from.begin() + hot);
+        for (size_t i = 0; i < hot; i++) s.miscased.push_back(preloaded ? miscase(from[i], rng) : from[i]);
+        // From the other end of the samples, so that none of them were looked up before
+        for (size_t i = 0; i < first; i++) {
+            const std::string& p = from[from.size() - 1 - i];
+            s.cold.push_back(preloaded ? miscase(p, rng) : p);
+        }
+        for (size_t i = 0; i < std::min<size_t>(deep_from.size(), 4096); i++) {
+            s.deep.push_back(preloaded ? miscase(deep_from[i], rng) : deep_from[i]);
+        }
+        for (size_t i = 0; i < hot; i++) {
+            std::string dir = from[i].substr(0, from[i].rfind('/'));
+            s.missing.push_back((preloaded ? miscase(dir, rng) : dir) + "/Missing" + std::to_string(i) + ".h");
+        }
+        return s;
+    };
+    Samples file_samples = make_samples(shuffled, deep);
+    Samples dir_samples = make_samples(directories, directories);
+
+    std::vector<Result> results;
+    for (const EntryPoint& e : entry_points) {
+        const Samples& s = e.directories ? dir_samples : file_samples;
+        // The first lookups are measured before anything is cached in this process
+        results.push_back(cold(e, "cold_miss", s.cold));
+        results.push_back(cold(e, "deep_miscased", s.deep));
+        results.push_back(warm(e, "exact", s.exact, iterations, true));
+        results.push_back(warm(e, "cache_hit", s.miscased, iterations, true));
+        results.push_back(warm(e, "negative", s.missing, iterations, false));
+    }
+
+    printf("%-10s %-14s %10s %8s %9s\n", "function", "scenario", "ns/call", "calls", "failures");
+    for (const Result& r : results) {
+        printf("%-10s %-14s %10.1f %8zu %9zu\n", r.function, r.scenario, r.ns, r.calls, r.failures);
+    }
+
+    if (output) {
+        FILE* f = fopen(output, "w");
+        if (!f) {
+            perror("lookups: fopen");
+            return EXIT_FAILURE;
+        }
+        fprintf(f, "{\n  \"preloaded\": %s,\n  \"files\": %zu,\n  \"directories\": %zu,\n  \"iterations\": %ld,\n",
+                preloaded ? "true" : "false", files.size(), directories.size(), iterations);
+        fprintf(f, "  \"results\": [");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            fprintf(f, "%s\n    {\"function\": \"%s\", \"scenario\": \"%s\", \"ns_per_call\": %.1f, \"calls\": %zu, "
+                       "\"failures\": %zu}", i ? "," : "", r.function, r.scenario, r.ns, r.calls, r.failures);
+        }
+        fprintf(f, "\n  ]\n}\n");
+        fclose(f);
+    }
+    close(root_fd);
+    return EXIT_SUCCESS;
+}
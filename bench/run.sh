@@ -0,0 +1,54 @@
+#!/bin/bash
+# Measure every intercepted entry point on a synthetic tree shaped like
+# /opt/xwin: without the library, with it, and with it and a prebuilt index of
+# the tree, then the cost of starting processes with the library preloaded,
+# and with a build of it that loads the shared C++ runtime. Builds the library,
+# insensitive-index and the benchmarks from this checkout first, and writes the
+# results as JSON to the output directory:
+#
+# bench/run.sh [output directory] [iterations]
+#
+# Compare the results of two checkouts with bench/compare.py <before> <after>.
+# CXX selects the compiler, clang++ by default.
+set -e
+
+repo=$(cd "$(dirname "$0")/.." && pwd)
+out=${1:-bench-results}
+iterations=${2:-200000}
+CXX=${CXX:-clang++}
+
+work=$(mktemp -d /tmp/insensitive-bench-XXXXXX)
+trap 'rm -rf "$work"' EXIT
+
+# The flags of the Dockerfile
+runtime=(-fno-exceptions -fno-rtti -static-libstdc++ -static-libgcc -Wl,--exclude-libs,ALL
+         -fvisibility=hidden -fvisibility-inlines-hidden -Wl,--version-script="$repo/insensitive.map")
+$CXX -O3 -std=c++20 -fPIC "${runtime[@]}" -DINSENSITIVE_LOG_LEVEL=-1 "$repo/insensitive.cpp" -shared \
+    -o "$work/libinsensitive.so"
+$CXX -O3 -std=c++20 -fPIC -DINSENSITIVE_LOG_LEVEL=-1 "$repo/insensitive.cpp" -shared \
+    -o "$work/libinsensitive-libstdc++.so"
+$CXX -O3 -std=c++20 "$repo/insensitive-index.cpp" -o "$work/insensitive-index"
+$CXX -O2 -std=c++20 "$repo/bench/lookups.cpp" -o "$work/lookups"
+$CXX -O2 -std=c++20 "$repo/bench/spawn.cpp" -o "$work/spawn"
+python3 "$repo/bench/sdk_tree.py" "$work/xwin"
+"$work/insensitive-index" -o "$work/xwin.idx" "$work/xwin/crt" "$work/xwin/sdk"
+
+# Only the settings of each run apply, not those of the environment or of the
+# wrappers that started this script
+clean=(env -u LD_PRELOAD -u INSENSITIVE_SESSION -u INSENSITIVE_STATS -u INSENSITIVE_RECORD -u INSENSITIVE_DEBUG
+       -u INSENSITIVE_ROOTS -u INSENSITIVE_EXCLUDE -u INSENSITIVE_OPTIMISTIC)
+mkdir -p "$out"
+
+echo "Without the library:"
+"${clean[@]}" "$work/lookups" -n "$iterations" -o "$out/baseline.json" "$work/xwin"
+echo
+echo "With the library:"
+"${clean[@]}" INSENSITIVE_INDEX= LD_PRELOAD="$work/libinsensitive.so" \
+    "$work/lookups" -n "$iterations" -o "$out/preload.json" "$work/xwin"
+echo
+echo "With the library and an index of the tree:"
+"${clean[@]}" INSENSITIVE_INDEX="$work/xwin.idx" LD_PRELOAD="$work/libinsensitive.so" \
+    "$work/lookups" -n "$iterations" -o "$out/preload-index.json" "$work/xwin"
+echo
+echo "Starting /bin/true:"
+"${clean[@]}" "$work/spawn" -n 10000 -o "$out/spawn.json" "$work/libinsensitive.so" "$work/libinsensitive-libstdc++.so"
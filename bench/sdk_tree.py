@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""
+sdk_tree - Generate a synthetic tree shaped like /opt/xwin for benchmarks
+
+The tree has the crt and sdk directories of an xwin splat: tens of thousands
+of headers in mixed case spread over a few very large directories and many
+small ones, import libraries, and deeply nested directories like those of
+cppwinrt. The files are empty. Every file path is listed in <root>/paths.txt,
+relative to the root, for the benchmarks to pick from.
+"""
+
+import argparse
+import os
+import random
+import sys
+from pathlib import Path
+
+
+# Words that SDK header names are made of
+WORDS = ['win', 'user', 'base', 'nt', 'def', 'sdk', 'ver', 'api', 'shell', 'ole', 'com', 'ctl', 'dx',
+         'gi', 'd3d', 'media', 'sock', 'crypt', 'ui', 'auto', 'mation', 'core', 'proc', 'thread',
+         'file', 'io', 'net', 'http', 'security', 'token', 'reg', 'str', 'safe', 'ks', 'mm', 'reg',
+         'dev', 'prop', 'key', 'sens', 'print', 'spool', 'xaml', 'direct', 'composition', 'ink']
+
+# (directory, share of the headers, depth of extra nesting)
+LAYOUT = [
+    ('sdk/include/um', 0.40, 0),
+    ('sdk/include/shared', 0.08, 0),
+    ('sdk/include/ucrt', 0.02, 1),
+    ('sdk/include/winrt', 0.15, 0),
+    ('sdk/include/cppwinrt/winrt/impl', 0.20, 0),
+    ('sdk/include/km', 0.05, 2),
+    ('crt/include', 0.03, 1),
+    ('sdk/include/Deep/Nested', 0.07, 8),
+]
+
+LIBRARY_DIRS = ['sdk/lib/um/x86_64', 'sdk/lib/ucrt/x86_64', 'crt/lib/x86_64']
+
+
+def mixed_case(word, rng):
+    """Capitalize a word the way SDK names are, or not"""
+    style = rng.random()
+    if style < 0.45:
+        return word
+    if style < 0.85:
+        return word.capitalize()
+    return word.upper()
+
+
+def make_name(rng, extension):
+    parts = [mixed_case(rng.choice(WORDS), rng) for _ in range(rng.randint(1, 4))]
+    if rng.random() < 0.2:
+        parts.append(str(rng.randint(1, 12)))
+    separator = '.' if extension == '.h' and rng.random() < 0.1 else ''
+    return separator.join(parts) + (extension.upper() if rng.random() < 0.05 else extension)
+
+
+def nested_dir(base, depth, rng):
+    parts = [base]
+    for _ in range(depth):
+        parts.append(mixed_case(rng.choice(WORDS), rng) + mixed_case(rng.choice(WORDS), rng))
+    return '/'.join(parts)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Generate a synthetic tree shaped like /opt/xwin',
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+        epilog='''
+Examples:
+  bench/sdk_tree.py /tmp/xwin
+  bench/sdk_tree.py --headers 50000 --seed 7 /tmp/xwin
+''')
+    parser.add_argument('root', help='Directory to create the tree in, which must not exist')
+    parser.add_argument('--headers', type=int, default=30000, help='Number of headers (default: 30000)')
+    parser.add_argument('--libraries', type=int, default=2000, help='Number of import libraries (default: 2000)')
+    parser.add_argument('--seed', type=int, default=1, help='Random seed, the same seed makes the same tree')
+    args = parser.parse_args()
+
+    root = Path(args.root)
+    if root.exists():
+        print(f'sdk_tree: {root} already exists', file=sys.stderr)
+        return 1
+    rng = random.Random(args.seed)
+
+    paths = []
+    seen = set()
+
+    def add(directory, name):
+        # Names that differ only in case can't both exist on the Windows
+        # side, so they aren't generated either
+        folded = f'{directory}/{name}'.lower()
+        if folded in seen:
+            return False
+        seen.add(folded)
+        paths.append(f'{directory}/{name}')
+        return True
+
+    for base, share, depth in LAYOUT:
+        count = int(args.headers * share)
+        # Nested layouts spread their headers over several directories
+        directories = [nested_dir(base, depth, rng) for _ in range(max(1, count // 200))] if depth else [base]
+        added = 0
+        while added < count:
+            if add(rng.choice(directories), make_name(rng, '.h')):
+                added += 1
+
+    for i in range(args.libraries):
+        while not add(LIBRARY_DIRS[i % len(LIBRARY_DIRS)], make_name(rng, '.lib')):
+            pass
+
+    # The names the benchmarks rely on
+    for directory, name in [('sdk/include/um', 'Windows.h'), ('sdk/include/shared', 'WinAPIFamily.h'),
+                            ('sdk/lib/um/x86_64', 'kernel32.Lib'), ('crt/include', 'vcruntime.h')]:
+        add(directory, name)
+
+    for path in paths:
+        full = root / path
+        full.parent.mkdir(parents=True, exist_ok=True)
+        full.touch()
+
+    with open(root / 'paths.txt', 'w') as f:
+        for path in paths:
+            f.write(path + '\n')
+    print(f'sdk_tree: {len(paths)} files in {len(set(os.path.dirname(p) for p in paths))} directories under {root}')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,103 @@
+// Measure the cost of starting processes with libinsensitive.so preloaded,
+// which every process of a build pays, from /bin/sh to sed, whether or not
+// it opens a single miscased path. Starts a program repeatedly without
+// anything preloaded, then with each of the given libraries, and reports the
+// time per process and its overhead. bench/run.sh builds and runs it:
+//
+// clang++ -O2 -std=c++20 bench/spawn.cpp -o spawn
+// ./spawn [-n processes] [-p program] [-o results.json] [library...]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// Seconds to start and wait for `count` processes of `program`, with
+// `library` preloaded unless null
+static double run(const char* program, const char* library, long count) {
+    // The environment of this process, without its own preloads
+    std::vector<std::string> variables;
+    for (char** e = environ; *e; e++) {
+        if (strncmp(*e, "LD_PRELOAD=", 11) != 0) variables.push_back(*e);
+    }
+    if (library) variables.push_back(std::string("LD_PRELOAD=") + library);
+    std::vector<char*> env;
+    for (std::string& v : variables) env.push_back(v.data());
+    env.push_back(nullptr);
+
+    char* argv[] = {const_cast<char*>(program), nullptr};
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < count; i++) {
+        pid_t child;
+        int status;
+        if (posix_spawn(&child, program, nullptr, nullptr, argv, env.data()) != 0 ||
+            waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "spawn: %s failed with %s\n", program, library ? library : "nothing preloaded");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: spawn [-n processes] [-p program] [-o results.json] [library...]\n");
+}
+
+int main(int argc, char* argv[]) {
+    long count = 10000;
+    const char* program = "/bin/true";
+    const char* output = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:o:h")) != -1) {
+        switch (opt) {
+        case 'n': count = atol(optarg); break;
+        case 'p': program = optarg; break;
+        case 'o': output = optarg; break;
+        default: usage(); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (count < 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // A few processes first, so that the program and libraries are in the page cache
+    run(program, nullptr, 10);
+    for (int i = optind; i < argc; i++) run(program, argv[i], 10);
+
+    std::vector<double> seconds{run(program, nullptr, count)};
+    printf("%-40s %10s %9s\n", "preloaded", "us/process", "overhead");
+    printf("%-40s %10.1f %9s\n", "nothing", seconds[0] * 1e6 / count, "");
+    for (int i = optind; i < argc; i++) {
+        seconds.push_back(run(program, argv[i], count));
+        printf("%-40s %10.1f %+8.1f%%\n", argv[i], seconds.back() * 1e6 / count,
+               100 * (seconds.back() / seconds[0] - 1));
+    }
+
+    // In the format of bench/lookups.cpp, for bench/compare.py, with the
+    // file name of each library as the scenario
+    if (output) {
+        FILE* f = fopen(output, "w");
+        if (!f) {
+            perror("spawn: fopen");
+            return EXIT_FAILURE;
+        }
+        fprintf(f, "{\n  \"program\": \"%s\",\n  \"processes\": %ld,\n  \"results\": [", program, count);
+        for (size_t i = 0; i < seconds.size(); i++) {
+            const char* library = i ? argv[optind + i - 1] : "nothing";
+            const char* name = strrchr(library, '/') ? strrchr(library, '/') + 1 : library;
+            fprintf(f, "%s\n    {\"function\": \"spawn\", \"scenario\": \"%s\", \"ns_per_call\": %.1f, "
+                       "\"calls\": %ld, \"failures\": 0}", i ? "," : "", name, seconds[i] * 1e9 / count, count);
+        }
+        fprintf(f, "\n  ]\n}\n");
+        fclose(f);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,435 @@
+// Case folding shared by libinsensitive.so and insensitive-index.
+// Names compare the way NTFS compares them: ASCII letters fold independently
+// of the locale, and the other characters of UTF-8 names through an upcase
+// table like the one Windows uses, so that every process and the prebuilt
+// index agree on which names are equal. ASCII runs, by far the most common,
+// go through SSE2 or AVX2 kernels selected when first used.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CASEFOLD_X86_64 1
+#endif
+
+inline char fold_char(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// Uppercase of a non-ASCII code point: the simple mappings of the scripts
+// found in file names, as in the NTFS upcase table. The two mappings into
+// ASCII (dotless i and long s) are left out, so that an ASCII name never
+// equals a non-ASCII one and ASCII runs can be compared byte by byte
+inline uint32_t upcase_code_point(uint32_t c) {
+    if (c < 0x100) {
+        if (c >= 0xe0 && c <= 0xfe && c != 0xf7) return c - 0x20;
+        return c == 0xff ? 0x178 : c;
+    }
+    if (c < 0x180) {
+        if (c == 0x131 || c == 0x138 || c == 0x149 || c == 0x17f) return c;
+        if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) return (c & 1) ? c : c - 1;
+        return (c & 1) ? c - 1 : c;
+    }
+    if (c < 0x250) {
+        switch (c) {
+        case 0x1c5: case 0x1c6: return 0x1c4;
+        case 0x1c8: case 0x1c9: return 0x1c7;
+        case 0x1cb: case 0x1cc: return 0x1ca;
+        case 0x1f2: case 0x1f3: return 0x1f1;
+        }
+        if (c >= 0x1cd && c <= 0x1dc) return (c & 1) ? c : c - 1;
+        if ((c >= 0x1de && c <= 0x1ef) || (c >= 0x1f8 && c <= 0x21f) ||
+            (c >= 0x222 && c <= 0x233) || (c >= 0x246 && c <= 0x24f)) {
+            return (c & 1) ? c - 1 : c;
+        }
+        return c;
+    }
+    if (c < 0x400) {
+        if (c == 0x3c2) return 0x3a3;
+        if (c >= 0x3b1 && c <= 0x3cb) return c - 0x20;
+        if (c == 0x3ac) return 0x386;
+        if (c >= 0x3ad && c <= 0x3af) return c - 0x25;
+        if (c == 0x3cc) return 0x38c;
+        if (c == 0x3cd || c == 0x3ce) return c - 0x3f;
+        if (c >= 0x3d8 && c <= 0x3ef) return (c & 1) ? c - 1 : c;
+        return c;
+    }
+    if (c < 0x590) {
+        if (c >= 0x430 && c <= 0x44f) return c - 0x20;
+        if (c >= 0x450 && c <= 0x45f) return c - 0x50;
+        if ((c >= 0x460 && c <= 0x481) || (c >= 0x48a && c <= 0x4bf) || (c >= 0x4d0 && c <= 0x52f)) {
+            return (c & 1) ? c - 1 : c;
+        }
+        if (c >= 0x4c1 && c <= 0x4ce) return (c & 1) ? c : c - 1;
+        if (c == 0x4cf) return 0x4c0;
+        if (c >= 0x561 && c <= 0x586) return c - 0x30;
+        return c;
+    }
+    if ((c >= 0x1e00 && c <= 0x1e95) || (c >= 0x1ea0 && c <= 0x1eff)) return (c & 1) ? c - 1 : c;
+    if (c >= 0x2170 && c <= 0x217f) return c - 0x10;
+    if (c >= 0x24d0 && c <= 0x24e9) return c - 0x1a;
+    if (c >= 0xff41 && c <= 0xff5a) return c - 0x20;
+    return c;
+}
+
+namespace casefold_detail {
+
+constexpr uint64_t high_bits = 0x8080808080808080ull;
+
+// Bytes that don't start a valid UTF-8 sequence decode on their own to a value
+// above U+10FFFF, so they never fold and only equal the same byte
+constexpr uint32_t invalid_base = 0x110000;
+
+inline uint32_t decode_utf8(const unsigned char*& p, const unsigned char* end) {
+    uint32_t c = *p;
+    if (c < 0x80) {
+        p++;
+        return c;
+    }
+    int n = c >= 0xf5 ? 0 : c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc2 ? 1 : 0;
+    if (n == 0 || end - p <= n) {
+        p++;
+        return invalid_base + c;
+    }
+    uint32_t code = c & (0x3f >> n);
+    for (int i = 1; i <= n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            p++;
+            return invalid_base + c;
+        }
+        code = code << 6 | (p[i] & 0x3f);
+    }
+    if ((n == 2 && (code < 0x800 || (code >= 0xd800 && code <= 0xdfff))) ||
+        (n == 3 && (code < 0x10000 || code > 0x10ffff))) {
+        p++;
+        return invalid_base + c;
+    }
+    p += n + 1;
+    return code;
+}
+
+inline uint32_t fold_code_point(uint32_t c) {
+    if (c < 0x80) return static_cast<unsigned char>(fold_char(static_cast<char>(c)));
+    return c < invalid_base ? upcase_code_point(c) : c;
+}
+
+// Pass the folded bytes of `s` to `sink` one by one: ASCII letters lowered,
+// other characters upcased and encoded again, invalid bytes unchanged
+template<typename Sink>
+inline void fold_utf8(std::string_view s, Sink&& sink) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(s.data());
+    const unsigned char* end = p + s.size();
+    while (p < end) {
+        uint32_t c = fold_code_point(decode_utf8(p, end));
+        if (c < 0x80) {
+            sink(static_cast<unsigned char>(c));
+        } else if (c >= invalid_base) {
+            sink(static_cast<unsigned char>(c - invalid_base));
+        } else if (c < 0x800) {
+            sink(static_cast<unsigned char>(0xc0 | c >> 6));
+            sink(static_cast<unsigned char>(0x80 | (c & 0x3f)));
+        } else if (c < 0x10000) {
+            sink(static_cast<unsigned char>(0xe0 | c >> 12));
+            sink(static_cast<unsigned char>(0x80 | (c >> 6 & 0x3f)));
+            sink(static_cast<unsigned char>(0x80 | (c & 0x3f)));
+        } else {
+            sink(static_cast<unsigned char>(0xf0 | c >> 18));
+            sink(static_cast<unsigned char>(0x80 | (c >> 12 & 0x3f)));
+            sink(static_cast<unsigned char>(0x80 | (c >> 6 & 0x3f)));
+            sink(static_cast<unsigned char>(0x80 | (c & 0x3f)));
+        }
+    }
+}
+
+inline bool fold_equals_utf8(std::string_view a, std::string_view b) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(a.data());
+    const unsigned char* p_end = p + a.size();
+    const unsigned char* q = reinterpret_cast<const unsigned char*>(b.data());
+    const unsigned char* q_end = q + b.size();
+    while (p < p_end && q < q_end) {
+        if (fold_code_point(decode_utf8(p, p_end)) != fold_code_point(decode_utf8(q, q_end))) return false;
+    }
+    return p == p_end && q == q_end;
+}
+
+inline bool is_ascii(std::string_view s) {
+    size_t i = 0;
+    uint64_t any = 0;
+    for (; i + 8 <= s.size(); i += 8) {
+        uint64_t w;
+        memcpy(&w, s.data() + i, 8);
+        any |= w;
+    }
+    for (; i < s.size(); i++) any |= static_cast<unsigned char>(s[i]);
+    return (any & high_bits) == 0;
+}
+
+// The hash works on 8-byte little-endian words of the folded bytes, so that
+// every kernel and the UTF-8 path feed it the same words, however far they
+// get through the name before handing over to the next
+inline uint64_t mix_word(uint64_t h, uint64_t word) {
+    h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+    return h << 31 | h >> 33;
+}
+
+struct FoldHasher {
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint64_t word = 0;
+    unsigned fill = 0;
+    size_t length = 0;
+
+    void add_byte(unsigned char c) {
+        word |= uint64_t(c) << (8 * fill);
+        length++;
+        if (++fill == 8) {
+            h = mix_word(h, word);
+            word = 0;
+            fill = 0;
+        }
+    }
+
+    // Finished with a 64-bit mixer so that all the bits are usable for bucket
+    // and slot selection
+    uint64_t finish() {
+        if (fill) h = mix_word(h, word);
+        h ^= length;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+// Lower the ASCII letters of 8 ASCII bytes at once
+inline uint64_t fold_word(uint64_t w) {
+    uint64_t at_least_a = w + 0x3f3f3f3f3f3f3f3full;  // high bit set from 'A'
+    uint64_t above_z = w + 0x2525252525252525ull;     // high bit set after 'Z'
+    return w | ((at_least_a & ~above_z & high_bits) >> 2);
+}
+
+// Every kernel works on the leading ASCII part of its input, and returns how
+// far it got, leaving the rest to the UTF-8 path:
+//   fold:    writes the folded bytes of whole ASCII words to `out`
+//   compare: 1 if the strings are equal, 0 if they differ at an ASCII byte,
+//            -1 if a non-ASCII byte differs and the UTF-8 path must decide
+//   hash:    mixes whole ASCII words into `h`
+struct Kernels {
+    const char* name;
+    size_t (*fold)(char* out, const char* s, size_t n);
+    int (*compare)(const char* a, const char* b, size_t n);
+    size_t (*hash)(const char* s, size_t n, uint64_t& h);
+};
+
+inline int compare_tail(const char* a, const char* b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] == b[i]) continue;
+        if ((a[i] | b[i]) & 0x80) return -1;
+        if (fold_char(a[i]) != fold_char(b[i])) return 0;
+    }
+    return 1;
+}
+
+inline size_t fold_scalar(char* out, const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        if (w & high_bits) break;
+        w = fold_word(w);
+        memcpy(out + i, &w, 8);
+    }
+    return i;
+}
+
+inline int compare_scalar(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa == wb) continue;
+        if ((wa | wb) & high_bits) return -1;
+        if (fold_word(wa) != fold_word(wb)) return 0;
+    }
+    return compare_tail(a + i, b + i, n - i);
+}
+
+inline size_t hash_scalar(const char* s, size_t n, uint64_t& h) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        if (w & high_bits) break;
+        h = mix_word(h, fold_word(w));
+    }
+    return i;
+}
+
+inline constexpr Kernels scalar_kernels{"scalar", fold_scalar, compare_scalar, hash_scalar};
+
+#ifdef CASEFOLD_X86_64
+
+// Bytes from 0x80 are negative as signed bytes, so they are never in range
+inline __m128i fold_bytes_sse2(__m128i v) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+inline size_t fold_sse2(char* out, const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (_mm_movemask_epi8(v)) break;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), fold_bytes_sse2(v));
+    }
+    return i + fold_scalar(out + i, s + i, n - i);
+}
+
+inline int compare_sse2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff) continue;
+        if (_mm_movemask_epi8(_mm_or_si128(va, vb))) return -1;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(fold_bytes_sse2(va), fold_bytes_sse2(vb))) != 0xffff) return 0;
+    }
+    return compare_scalar(a + i, b + i, n - i);
+}
+
+inline size_t hash_sse2(const char* s, size_t n, uint64_t& h) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (_mm_movemask_epi8(v)) break;
+        v = fold_bytes_sse2(v);
+        h = mix_word(h, _mm_cvtsi128_si64(v));
+        h = mix_word(h, _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+    }
+    return i + hash_scalar(s + i, n - i, h);
+}
+
+__attribute__((target("avx2"))) inline __m256i fold_bytes_avx2(__m256i v) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) inline size_t fold_avx2(char* out, const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        if (_mm256_movemask_epi8(v)) break;
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), fold_bytes_avx2(v));
+    }
+    return i + fold_sse2(out + i, s + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline int compare_avx2(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) == -1) continue;
+        if (_mm256_movemask_epi8(_mm256_or_si256(va, vb))) return -1;
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(fold_bytes_avx2(va), fold_bytes_avx2(vb))) != -1) return 0;
+    }
+    return compare_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline size_t hash_avx2(const char* s, size_t n, uint64_t& h) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        if (_mm256_movemask_epi8(v)) break;
+        v = fold_bytes_avx2(v);
+        __m128i low = _mm256_castsi256_si128(v);
+        __m128i high = _mm256_extracti128_si256(v, 1);
+        h = mix_word(h, _mm_cvtsi128_si64(low));
+        h = mix_word(h, _mm_cvtsi128_si64(_mm_unpackhi_epi64(low, low)));
+        h = mix_word(h, _mm_cvtsi128_si64(high));
+        h = mix_word(h, _mm_cvtsi128_si64(_mm_unpackhi_epi64(high, high)));
+    }
+    return i + hash_sse2(s + i, n - i, h);
+}
+
+inline constexpr Kernels sse2_kernels{"sse2", fold_sse2, compare_sse2, hash_sse2};
+inline constexpr Kernels avx2_kernels{"avx2", fold_avx2, compare_avx2, hash_avx2};
+
+#endif
+
+// SSE2 is part of x86-64, AVX2 is used where the CPU has it
+inline const Kernels& kernels() {
+    static const Kernels& selected = []() -> const Kernels& {
+#ifdef CASEFOLD_X86_64
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return avx2_kernels;
+        return sse2_kernels;
+#else
+        return scalar_kernels;
+#endif
+    }();
+    return selected;
+}
+
+inline std::string fold_string(std::string_view s, const Kernels& k) {
+    std::string folded(s.size(), '\0');
+    size_t done = k.fold(&folded[0], s.data(), s.size());
+    folded.resize(done);
+    fold_utf8(s.substr(done), [&](unsigned char c) { folded += static_cast<char>(c); });
+    return folded;
+}
+
+inline bool fold_equals(std::string_view a, std::string_view b, const Kernels& k) {
+    if (a.size() == b.size()) {
+        int equal = k.compare(a.data(), b.data(), a.size());
+        if (equal >= 0) return equal;
+    } else if (is_ascii(a) && is_ascii(b)) {
+        return false;
+    }
+    return fold_equals_utf8(a, b);
+}
+
+inline uint64_t fold_hash(std::string_view s, const Kernels& k) {
+    FoldHasher hasher;
+    size_t done = k.hash(s.data(), s.size(), hasher.h);
+    hasher.length = done;
+    fold_utf8(s.substr(done), [&](unsigned char c) { hasher.add_byte(c); });
+    return hasher.finish();
+}
+
+} // namespace casefold_detail
+
+// The folded form of a name: equal for exactly the names that fold_equals()
+// finds equal, and hashed to the same value by fold_hash()
+inline std::string fold_string(std::string_view s) {
+    return casefold_detail::fold_string(s, casefold_detail::kernels());
+}
+
+inline bool fold_equals(std::string_view a, std::string_view b) {
+    return casefold_detail::fold_equals(a, b, casefold_detail::kernels());
+}
+
+inline uint64_t fold_hash(std::string_view s) {
+    return casefold_detail::fold_hash(s, casefold_detail::kernels());
+}
+
+// Transparent hash and equality for containers of names that are looked up
+// in any case, without folding the query into a temporary string first
+struct FoldHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return fold_hash(s); }
+};
+
+struct FoldEqual {
+    using is_transparent = void;
+    bool operator()(std::string_view a, std::string_view b) const { return fold_equals(a, b); }
+};
@@ -0,0 +1,150 @@
+// Memory-mapped index of read-only directory trees, written by insensitive-index
+// and read by libinsensitive.so. It maps every path under the indexed roots from
+// its folded form to its real form through a hash-and-displace perfect hash, so
+// a lookup is one probe and one comparison. Only the real paths are stored: a key
+// matches a slot when it folds to the same bytes as the slot's real path. Paths
+// that differ only by case, such as windows.h next to Windows.h, share a slot,
+// which lists the others as variants so that each of them resolves to itself.
+//
+// Layout, all offsets from the start of the file:
+//   Header
+//   Span roots[root_count]       real paths of the indexed roots
+//   uint32_t seeds[bucket_count] displacement seed of each bucket
+//   Slot slots[slot_count]       real path of each slot, empty for a free slot
+//   Span variants[variant_count] other real paths of the slots, slot by slot
+//   char strings[]               path bytes referenced by the spans
+#pragma once
+
+#include "casefold.h"
+
+#include <cstring>
+
+class CasefoldIndex {
+public:
+    static constexpr char magic[8] = "INSIDX3";
+
+    struct Span {
+        uint32_t offset; // into strings
+        uint32_t length;
+    };
+
+    struct Slot {
+        Span path;
+        uint32_t first_variant; // into variants
+        uint32_t variant_count;
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t root_count;
+        uint32_t bucket_count;
+        uint32_t slot_count;
+        uint32_t entry_count;
+        uint32_t variant_count;
+        uint32_t reserved;
+        uint64_t roots_offset;
+        uint64_t seeds_offset;
+        uint64_t slots_offset;
+        uint64_t variants_offset;
+        uint64_t strings_offset;
+        uint64_t file_size;
+    };
+
+    static uint32_t bucket_of(uint64_t hash, uint32_t bucket_count) {
+        return static_cast<uint32_t>((hash >> 32) % bucket_count);
+    }
+
+    static uint32_t slot_of(uint64_t hash, uint32_t seed, uint32_t slot_count) {
+        uint64_t h = hash ^ (seed * 0x9e3779b97f4a7c15ull);
+        h ^= h >> 31;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 29;
+        return static_cast<uint32_t>(h % slot_count);
+    }
+
+    // Validate and use an index image, which must outlive this object
+    bool attach(const void* data, size_t size) {
+        if (size < sizeof(Header)) return false;
+        const Header* h = static_cast<const Header*>(data);
+        if (memcmp(h->magic, magic, sizeof(magic)) != 0 || h->file_size != size) return false;
+        if (h->bucket_count == 0 || h->slot_count == 0) return false;
+        if (!fits(h->roots_offset, uint64_t(h->root_count) * sizeof(Span), size) ||
+            !fits(h->seeds_offset, uint64_t(h->bucket_count) * sizeof(uint32_t), size) ||
+            !fits(h->slots_offset, uint64_t(h->slot_count) * sizeof(Slot), size) ||
+            !fits(h->variants_offset, uint64_t(h->variant_count) * sizeof(Span), size) ||
+            !fits(h->strings_offset, 0, size)) {
+            return false;
+        }
+
+        const char* base = static_cast<const char*>(data);
+        header = h;
+        roots = reinterpret_cast<const Span*>(base + h->roots_offset);
+        seeds = reinterpret_cast<const uint32_t*>(base + h->seeds_offset);
+        slots = reinterpret_cast<const Slot*>(base + h->slots_offset);
+        variants = reinterpret_cast<const Span*>(base + h->variants_offset);
+        strings = base + h->strings_offset;
+        strings_size = size - h->strings_offset;
+        return true;
+    }
+
+    bool attached() const { return header != nullptr; }
+
+    uint32_t entry_count() const { return header ? header->entry_count : 0; }
+
+    uint32_t root_count() const { return header ? header->root_count : 0; }
+
+    std::string_view root(uint32_t i) const { return string(roots[i]); }
+
+    // Check whether a path lies under one of the indexed roots, in any case
+    bool covers(std::string_view path) const {
+        if (!header) return false;
+        for (uint32_t i = 0; i < header->root_count; i++) {
+            std::string_view r = string(roots[i]);
+            if (path.size() >= r.size() && fold_equals(path.substr(0, r.size()), r) &&
+                (path.size() == r.size() || path[r.size()] == '/')) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Find the real path of a normalized absolute path under the indexed roots.
+    // A path that exists as given resolves to itself
+    bool lookup(std::string_view path, std::string_view& real_path) const {
+        if (!header) return false;
+        uint64_t h = fold_hash(path);
+        uint32_t seed = seeds[bucket_of(h, header->bucket_count)];
+        const Slot& slot = slots[slot_of(h, seed, header->slot_count)];
+        std::string_view candidate = string(slot.path);
+        if (candidate.empty() || !fold_equals(candidate, path)) return false;
+        real_path = candidate;
+        if (candidate != path && slot.variant_count) {
+            for (uint32_t i = 0; i < slot.variant_count && slot.first_variant + i < header->variant_count; i++) {
+                std::string_view variant = string(variants[slot.first_variant + i]);
+                if (variant == path) {
+                    real_path = variant;
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    const Header* header = nullptr;
+    const Span* roots = nullptr;
+    const uint32_t* seeds = nullptr;
+    const Slot* slots = nullptr;
+    const Span* variants = nullptr;
+    const char* strings = nullptr;
+    size_t strings_size = 0;
+
+    static bool fits(uint64_t offset, uint64_t length, size_t size) {
+        return offset <= size && length <= size - offset;
+    }
+
+    std::string_view string(const Span& span) const {
+        if (span.offset > strings_size || span.length > strings_size - span.offset) return {};
+        return std::string_view(strings + span.offset, span.length);
+    }
+};
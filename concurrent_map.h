@@ -0,0 +1,292 @@
+// Concurrent hash map for the caches of libinsensitive.so, which are read on
+// every intercepted call from all threads of a process, such as the linker's,
+// and written only when a path is resolved for the first time
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
+
+// Epoch-based reclamation for the lock-free readers of ConcurrentMap. A reader
+// publishes the global epoch it started in, and an object unlinked by a writer
+// is only freed once every reader still running started after it was unlinked.
+// Readers don't nest, and each thread publishes its epoch in its own cache line
+class EpochDomain {
+    static constexpr size_t max_readers = 256;
+
+    struct alignas(64) Reader {
+        std::atomic<uint64_t> epoch{0}; // 0 while not reading
+        std::atomic<bool> used{false};
+    };
+
+    struct Retired {
+        void* object;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    Reader readers[max_readers];
+    std::atomic<uint64_t> global_epoch{1};
+    // Threads beyond max_readers announce themselves here instead, and
+    // nothing is freed while any of them is reading
+    std::atomic<uint32_t> anonymous_readers{0};
+    std::mutex retired_mutex;
+    std::vector<Retired> retired;
+    pthread_key_t thread_key;
+
+    // Index of the thread's reader slot: -1 before the first read, -2 if
+    // all slots were taken. A process has a single domain
+    static inline thread_local int reader_index = -1;
+
+    // Return the slot of an exiting thread
+    static void release_reader(void* reader) {
+        static_cast<Reader*>(reader)->used.store(false, std::memory_order_release);
+    }
+
+    Reader* this_reader() {
+        if (reader_index == -1) {
+            reader_index = -2;
+            for (size_t i = 0; i < max_readers; i++) {
+                bool expected = false;
+                if (readers[i].used.compare_exchange_strong(expected, true)) {
+                    reader_index = i;
+                    pthread_setspecific(thread_key, &readers[i]);
+                    break;
+                }
+            }
+        }
+        return reader_index >= 0 ? &readers[reader_index] : nullptr;
+    }
+
+    void reclaim() {
+        if (anonymous_readers.load() != 0) return;
+
+        uint64_t oldest = UINT64_MAX;
+        for (const Reader& reader : readers) {
+            uint64_t epoch = reader.epoch.load();
+            if (epoch != 0 && epoch < oldest) oldest = epoch;
+        }
+
+        auto end = std::partition(retired.begin(), retired.end(),
+                                  [&](const Retired& r) { return r.epoch >= oldest; });
+        for (auto it = end; it != retired.end(); ++it) it->deleter(it->object);
+        retired.erase(end, retired.end());
+    }
+
+public:
+    EpochDomain() {
+        pthread_key_create(&thread_key, release_reader);
+    }
+
+    // Only destroyed once no thread uses the domain anymore
+    ~EpochDomain() {
+        for (const Retired& r : retired) r.deleter(r.object);
+    }
+
+    // Protects everything read from a ConcurrentMap during its lifetime
+    class Guard {
+        EpochDomain& domain;
+        Reader* reader;
+
+    public:
+        explicit Guard(EpochDomain& domain) : domain(domain), reader(domain.this_reader()) {
+            if (reader) {
+                reader->epoch.store(domain.global_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            } else {
+                domain.anonymous_readers.fetch_add(1);
+            }
+        }
+
+        ~Guard() {
+            if (reader) {
+                reader->epoch.store(0, std::memory_order_release);
+            } else {
+                domain.anonymous_readers.fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    // Free an object once no reader can see it anymore. It must already be
+    // unlinked from everything readers can reach
+    template<typename T>
+    void retire(T* object) {
+        uint64_t epoch = global_epoch.fetch_add(1);
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        retired.push_back(Retired{object, [](void* p) { delete static_cast<T*>(p); }, epoch});
+        if (retired.size() >= 64) reclaim();
+    }
+};
+
+// Hash map for read-mostly caches. Readers take no locks: every node is
+// immutable once published, and writers, serialized per shard, replace the
+// part of a chain they change with new nodes and retire the old ones through
+// the epoch domain. The generation changes whenever an existing entry is
+// replaced or erased, so that copies of entries made by readers can be
+// checked for staleness without a lookup
+template<typename Key, typename Value, typename Hash, typename Equal>
+class ConcurrentMap {
+    static constexpr size_t shard_bits = 6;
+    static constexpr size_t initial_buckets = 64;
+
+    struct Node {
+        size_t hash;
+        Key key;
+        Value value;
+        Node* next;
+    };
+
+    struct Table {
+        size_t mask;
+        std::unique_ptr<std::atomic<Node*>[]> buckets;
+
+        explicit Table(size_t size) : mask(size - 1), buckets(new std::atomic<Node*>[size]) {
+            for (size_t i = 0; i < size; i++) buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::atomic<Table*> table{nullptr};
+        size_t count = 0;
+    };
+
+    EpochDomain& epochs;
+    Shard shards[1 << shard_bits];
+    std::atomic<uint64_t> generation_{1};
+
+    Shard& shard_of(size_t hash) {
+        return shards[(hash * 0x9e3779b97f4a7c15ull) >> (64 - shard_bits)];
+    }
+
+    // Copy the chain from `head` up to `stop`, excluding it, in front of
+    // `tail`. The originals, including `stop`, are added to `unlinked`
+    static Node* copy_chain(Node* head, Node* stop, Node* tail, std::vector<Node*>& unlinked) {
+        if (head == stop) {
+            unlinked.push_back(stop);
+            return tail;
+        }
+        unlinked.push_back(head);
+        return new Node{head->hash, head->key, head->value, copy_chain(head->next, stop, tail, unlinked)};
+    }
+
+    Node* find_node(Node* head, size_t hash, const Key& key) const {
+        for (Node* node = head; node; node = node->next) {
+            if (node->hash == hash && Equal()(node->key, key)) return node;
+        }
+        return nullptr;
+    }
+
+    // Rehash a shard into a table twice as large, built from copies of the
+    // nodes so that readers of the old table are undisturbed
+    void grow(Shard& shard, Table* table) {
+        Table* larger = new Table((table->mask + 1) * 2);
+        std::vector<Node*> unlinked;
+        for (size_t i = 0; i <= table->mask; i++) {
+            for (Node* node = table->buckets[i].load(std::memory_order_relaxed); node; node = node->next) {
+                std::atomic<Node*>& bucket = larger->buckets[node->hash & larger->mask];
+                bucket.store(new Node{node->hash, node->key, node->value, bucket.load(std::memory_order_relaxed)},
+                             std::memory_order_relaxed);
+                unlinked.push_back(node);
+            }
+        }
+        shard.table.store(larger, std::memory_order_release);
+        for (Node* node : unlinked) epochs.retire(node);
+        epochs.retire(table);
+    }
+
+public:
+    explicit ConcurrentMap(EpochDomain& epochs) : epochs(epochs) {}
+
+    ~ConcurrentMap() {
+        for (Shard& shard : shards) {
+            Table* table = shard.table.load(std::memory_order_relaxed);
+            if (!table) continue;
+            for (size_t i = 0; i <= table->mask; i++) {
+                for (Node* node = table->buckets[i].load(std::memory_order_relaxed); node; ) {
+                    Node* next = node->next;
+                    delete node;
+                    node = next;
+                }
+            }
+            delete table;
+        }
+    }
+
+    uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+    // Call `visit` with the value of a key, if it is present. The value must
+    // not be used after `visit` returns
+    template<typename K, typename Visit>
+    bool find(const K& key, Visit&& visit) {
+        size_t hash = Hash()(key);
+        Shard& shard = shard_of(hash);
+        EpochDomain::Guard guard(epochs);
+        Table* table = shard.table.load(std::memory_order_acquire);
+        if (!table) return false;
+        for (Node* node = table->buckets[hash & table->mask].load(std::memory_order_acquire); node; node = node->next) {
+            if (node->hash == hash && Equal()(node->key, key)) {
+                visit(static_cast<const Value&>(node->value));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void insert_or_assign(Key key, Value value) {
+        size_t hash = Hash()(key);
+        Shard& shard = shard_of(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        if (!table) {
+            table = new Table(initial_buckets);
+            shard.table.store(table, std::memory_order_release);
+        }
+
+        std::atomic<Node*>& bucket = table->buckets[hash & table->mask];
+        Node* head = bucket.load(std::memory_order_relaxed);
+        Node* old = find_node(head, hash, key);
+        Node* node = new Node{hash, std::move(key), std::move(value), head};
+        if (!old) {
+            bucket.store(node, std::memory_order_release);
+            if (++shard.count > 2 * (table->mask + 1)) grow(shard, table);
+            return;
+        }
+
+        std::vector<Node*> unlinked;
+        node->next = copy_chain(head, old, old->next, unlinked);
+        bucket.store(node, std::memory_order_release);
+        generation_.fetch_add(1, std::memory_order_release);
+        for (Node* n : unlinked) epochs.retire(n);
+    }
+
+    template<typename K>
+    bool erase(const K& key) {
+        size_t hash = Hash()(key);
+        Shard& shard = shard_of(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        if (!table) return false;
+
+        std::atomic<Node*>& bucket = table->buckets[hash & table->mask];
+        Node* head = bucket.load(std::memory_order_relaxed);
+        Node* old = head;
+        while (old && !(old->hash == hash && Equal()(old->key, key))) old = old->next;
+        if (!old) return false;
+
+        std::vector<Node*> unlinked;
+        bucket.store(copy_chain(head, old, old->next, unlinked), std::memory_order_release);
+        shard.count--;
+        generation_.fetch_add(1, std::memory_order_release);
+        for (Node* n : unlinked) epochs.retire(n);
+        return true;
+    }
+};
@@ -0,0 +1,261 @@
+// Build the case-folded index of read-only directory trees for libinsensitive.so
+// clang++ -O3 -std=c++20 insensitive-index.cpp -o insensitive-index
+//
+// Usage: insensitive-index -o /opt/xwin/lib/libinsensitive.idx /opt/xwin/crt /opt/xwin/sdk
+//
+// The index must be rebuilt whenever the indexed trees change, because the
+// library answers every lookup under the roots from it, including misses.
+
+#include "casefold_index.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct DirId {
+    dev_t dev;
+    ino_t ino;
+};
+
+// Collect every path under a directory. Symbolic links to directories are
+// followed, since the library can't tell them apart from real directories
+// without a syscall, except when they loop back to one of their ancestors
+static bool walk(const std::string& dir, std::vector<DirId>& ancestors, std::vector<std::string>& paths) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "insensitive-index: cannot open '%s': %s\n", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        names.emplace_back(entry->d_name);
+    }
+    closedir(d);
+
+    bool ok = true;
+    for (const std::string& name : names) {
+        std::string path = dir + "/" + name;
+        paths.push_back(path);
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        bool loop = std::any_of(ancestors.begin(), ancestors.end(), [&](const DirId& a) {
+            return a.dev == st.st_dev && a.ino == st.st_ino;
+        });
+        if (loop) continue;
+
+        ancestors.push_back(DirId{st.st_dev, st.st_ino});
+        ok = walk(path, ancestors, paths) && ok;
+        ancestors.pop_back();
+    }
+    return ok;
+}
+
+// Assign every key a distinct slot by searching, bucket by bucket from the
+// largest, for a seed that sends all keys of the bucket to free slots
+static bool build_perfect_hash(const std::vector<uint64_t>& hashes, uint32_t bucket_count, uint32_t slot_count,
+                               std::vector<uint32_t>& seeds, std::vector<uint32_t>& slot_of_key) {
+    std::vector<std::vector<uint32_t>> buckets(bucket_count);
+    for (uint32_t i = 0; i < hashes.size(); i++) {
+        buckets[CasefoldIndex::bucket_of(hashes[i], bucket_count)].push_back(i);
+    }
+
+    std::vector<uint32_t> order(bucket_count);
+    for (uint32_t b = 0; b < bucket_count; b++) order[b] = b;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    seeds.assign(bucket_count, 0);
+    slot_of_key.assign(hashes.size(), 0);
+    std::vector<bool> taken(slot_count, false);
+    std::vector<uint32_t> candidate;
+
+    for (uint32_t b : order) {
+        const std::vector<uint32_t>& keys = buckets[b];
+        if (keys.empty()) break;
+
+        bool placed = false;
+        for (uint32_t seed = 0; seed < (1u << 20) && !placed; seed++) {
+            candidate.clear();
+            placed = true;
+            for (uint32_t key : keys) {
+                uint32_t slot = CasefoldIndex::slot_of(hashes[key], seed, slot_count);
+                if (taken[slot] || std::find(candidate.begin(), candidate.end(), slot) != candidate.end()) {
+                    placed = false;
+                    break;
+                }
+                candidate.push_back(slot);
+            }
+            if (placed) {
+                seeds[b] = seed;
+                for (size_t i = 0; i < keys.size(); i++) {
+                    taken[candidate[i]] = true;
+                    slot_of_key[keys[i]] = candidate[i];
+                }
+            }
+        }
+        if (!placed) return false;
+    }
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: insensitive-index -o <index> <root>...\n");
+}
+
+int main(int argc, char* argv[]) {
+    std::string output;
+    std::vector<std::string> roots;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage();
+            return EXIT_FAILURE;
+        } else {
+            std::string root = argv[i];
+            while (root.size() > 1 && root.back() == '/') root.pop_back();
+            if (root[0] != '/') {
+                fprintf(stderr, "insensitive-index: root '%s' must be an absolute path\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            roots.push_back(root);
+        }
+    }
+    if (output.empty() || roots.empty()) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // Collect the paths, sorted so that the first of several paths that
+    // differ only by case is chosen the same way on every run
+    std::vector<std::string> paths;
+    for (const std::string& root : roots) {
+        struct stat st;
+        if (stat(root.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "insensitive-index: root '%s' is not a directory\n", root.c_str());
+            return EXIT_FAILURE;
+        }
+        paths.push_back(root);
+        std::vector<DirId> ancestors{DirId{st.st_dev, st.st_ino}};
+        if (!walk(root, ancestors, paths)) return EXIT_FAILURE;
+    }
+    std::sort(paths.begin(), paths.end());
+
+    // The first of several paths that differ only by case takes the slot,
+    // and the others are its variants
+    std::vector<std::string> entries;
+    std::vector<std::vector<std::string>> entry_variants;
+    std::vector<uint64_t> hashes;
+    {
+        std::unordered_map<std::string, size_t> seen;
+        for (const std::string& path : paths) {
+            auto [it, added] = seen.emplace(fold_string(path), entries.size());
+            if (!added) {
+                entry_variants[it->second].push_back(path);
+                continue;
+            }
+            entries.push_back(path);
+            entry_variants.emplace_back();
+            hashes.push_back(fold_hash(path));
+        }
+    }
+
+    uint32_t entry_count = entries.size();
+    uint32_t bucket_count = std::max<uint32_t>(1, entry_count / 4);
+    uint32_t slot_count = entry_count + entry_count / 20 + 1;
+    std::vector<uint32_t> seeds, slot_of_key;
+    while (!build_perfect_hash(hashes, bucket_count, slot_count, seeds, slot_of_key)) {
+        slot_count += slot_count / 10 + 1;
+    }
+
+    // Lay out the file
+    std::string strings;
+    std::vector<CasefoldIndex::Span> root_spans;
+    for (const std::string& root : roots) {
+        root_spans.push_back(CasefoldIndex::Span{uint32_t(strings.size()), uint32_t(root.size())});
+        strings += root;
+    }
+    std::vector<CasefoldIndex::Slot> slots(slot_count, CasefoldIndex::Slot{{0, 0}, 0, 0});
+    std::vector<CasefoldIndex::Span> variants;
+    for (uint32_t i = 0; i < entry_count; i++) {
+        CasefoldIndex::Slot& slot = slots[slot_of_key[i]];
+        slot.path = CasefoldIndex::Span{uint32_t(strings.size()), uint32_t(entries[i].size())};
+        strings += entries[i];
+        slot.first_variant = variants.size();
+        slot.variant_count = entry_variants[i].size();
+        for (const std::string& variant : entry_variants[i]) {
+            variants.push_back(CasefoldIndex::Span{uint32_t(strings.size()), uint32_t(variant.size())});
+            strings += variant;
+        }
+    }
+
+    auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+    CasefoldIndex::Header header{};
+    memcpy(header.magic, CasefoldIndex::magic, sizeof(header.magic));
+    header.root_count = root_spans.size();
+    header.bucket_count = bucket_count;
+    header.slot_count = slot_count;
+    header.entry_count = entry_count;
+    header.variant_count = variants.size();
+    header.roots_offset = align(sizeof(header));
+    header.seeds_offset = align(header.roots_offset + root_spans.size() * sizeof(CasefoldIndex::Span));
+    header.slots_offset = align(header.seeds_offset + seeds.size() * sizeof(uint32_t));
+    header.variants_offset = align(header.slots_offset + slots.size() * sizeof(CasefoldIndex::Slot));
+    header.strings_offset = align(header.variants_offset + variants.size() * sizeof(CasefoldIndex::Span));
+    header.file_size = header.strings_offset + strings.size();
+
+    std::string image(header.file_size, '\0');
+    memcpy(&image[0], &header, sizeof(header));
+    memcpy(&image[header.roots_offset], root_spans.data(), root_spans.size() * sizeof(CasefoldIndex::Span));
+    memcpy(&image[header.seeds_offset], seeds.data(), seeds.size() * sizeof(uint32_t));
+    memcpy(&image[header.slots_offset], slots.data(), slots.size() * sizeof(CasefoldIndex::Slot));
+    memcpy(&image[header.variants_offset], variants.data(), variants.size() * sizeof(CasefoldIndex::Span));
+    memcpy(&image[header.strings_offset], strings.data(), strings.size());
+
+    // Check that every path is found in any case, and as itself when spelled
+    // exactly, before publishing the index
+    CasefoldIndex index;
+    if (!index.attach(image.data(), image.size())) {
+        fprintf(stderr, "insensitive-index: internal error, index image is invalid\n");
+        return EXIT_FAILURE;
+    }
+    for (const std::string& path : paths) {
+        std::string_view real_path;
+        if (!index.lookup(fold_string(path), real_path) || !fold_equals(real_path, path) ||
+            !index.lookup(path, real_path) || real_path != path) {
+            fprintf(stderr, "insensitive-index: internal error, '%s' not found\n", path.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Write to a temporary file first, so that processes never map a partial index
+    std::string temporary = output + ".tmp";
+    FILE* f = fopen(temporary.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "insensitive-index: cannot create '%s': %s\n", temporary.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+    bool written = fwrite(image.data(), 1, image.size(), f) == image.size();
+    written = fclose(f) == 0 && written;
+    if (!written || rename(temporary.c_str(), output.c_str()) != 0) {
+        fprintf(stderr, "insensitive-index: cannot write '%s': %s\n", output.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return EXIT_FAILURE;
+    }
+
+    printf("insensitive-index: %u paths and %zu case variants under %zu roots, %u slots, %zu bytes written to %s\n",
+           entry_count, variants.size(), roots.size(), slot_count, image.size(), output.c_str());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+// Replay a trace recorded with INSENSITIVE_RECORD through the path lookups of
+// libinsensitive.so, in the tree it was recorded in or in a snapshot of it,
+// and report their throughput and latency, so that changes to the resolver
+// can be compared on the lookups of a real build without running the build
+// clang++ -O3 -std=c++20 insensitive-replay.cpp -o insensitive-replay
+//
+// Usage: LD_PRELOAD=/opt/xwin/lib/libinsensitive.so insensitive-replay [-r root] [-a] [-w] [-n times] trace
+//
+//   -r root   directory the recorded tree was copied to, prefixed to every path
+//   -a        also look up the paths that the calls found as given, as with
+//             INSENSITIVE_OPTIMISTIC=0, rather than only those that were looked up
+//   -w        replay the lookups of all processes in this one, with the caches
+//             warm from the previous ones, rather than each recorded process in
+//             a process of its own like the build did
+//   -n times  replay the trace several times
+//
+// Lookups whose result differs from the recorded one are counted, since they
+// show that the tree changed or that the resolver resolves differently.
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using Resolve = const char* (*)(int dirfd, const char* path, int flags);
+
+struct Lookup {
+    std::string path;
+    std::string expected;
+    int flags;
+};
+
+// Results of the lookups, shared with the processes that replay them
+struct Results {
+    uint64_t mismatches;
+    uint64_t latency_ns[];
+};
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void replay(Resolve resolve, const std::vector<Lookup>& lookups, size_t first, Results* results) {
+    for (size_t i = 0; i < lookups.size(); i++) {
+        const Lookup& lookup = lookups[i];
+        uint64_t start = now();
+        const char* result = resolve(AT_FDCWD, lookup.path.c_str(), lookup.flags);
+        results->latency_ns[first + i] = now() - start;
+        if (lookup.expected != result) {
+            if (__atomic_fetch_add(&results->mismatches, 1, __ATOMIC_RELAXED) < 10) {
+                fprintf(stderr, "insensitive-replay: %s resolved to %s rather than %s\n", lookup.path.c_str(),
+                        result, lookup.expected.c_str());
+            }
+        }
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: insensitive-replay [-r root] [-a] [-w] [-n times] trace\n");
+}
+
+int main(int argc, char* argv[]) {
+    std::string root;
+    bool all = false;
+    bool warm = false;
+    long times = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:awn:h")) != -1) {
+        switch (opt) {
+        case 'r': root = optarg; break;
+        case 'a': all = true; break;
+        case 'w': warm = true; break;
+        case 'n': times = atol(optarg); break;
+        default: usage(); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || times < 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    while (!root.empty() && root.back() == '/') root.pop_back();
+
+    Resolve resolve = reinterpret_cast<Resolve>(dlsym(RTLD_DEFAULT, "insensitive_resolve"));
+    if (!resolve) {
+        fprintf(stderr, "insensitive-replay: insensitive_resolve not found, preload libinsensitive.so\n");
+        return EXIT_FAILURE;
+    }
+    if (const char* record = getenv("INSENSITIVE_RECORD"); record && *record) {
+        fprintf(stderr, "insensitive-replay: INSENSITIVE_RECORD is set, the replay would record itself\n");
+        return EXIT_FAILURE;
+    }
+
+    const char* trace_path = argv[optind];
+    int fd = open(trace_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "insensitive-replay: cannot open '%s': %s\n", trace_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    void* data = st.st_size ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    TraceReader reader;
+    if (data == MAP_FAILED || !reader.attach(data, st.st_size)) {
+        fprintf(stderr, "insensitive-replay: '%s' is not a trace of this version\n", trace_path);
+        return EXIT_FAILURE;
+    }
+
+    // The lookups of each recorded process, in the order the processes started
+    std::vector<std::vector<Lookup>> processes;
+    std::unordered_map<uint32_t, size_t> process_of;
+    size_t calls = 0, skipped = 0, lookup_count = 0;
+    TraceEntry entry;
+    while (reader.next(entry)) {
+        calls++;
+        const TraceRecord& r = entry.record;
+        if (!(r.flags & TraceRecord::LOOKED_UP) && !all) continue;
+        std::string base;
+        if (!entry.path.starts_with("/")) {
+            // The directory of a relative path could not be read
+            if (entry.base.empty()) {
+                skipped++;
+                continue;
+            }
+            base = std::string(entry.base) + "/";
+        }
+        Lookup lookup;
+        lookup.path = root + base + std::string(entry.path);
+        lookup.expected = entry.adjusted.empty() ? lookup.path : root + base + std::string(entry.adjusted);
+        lookup.flags = (r.flags & TraceRecord::KNOWN_MISSING ? 1 : 0) | (r.flags & TraceRecord::CREATES ? 2 : 0);
+
+        auto [process, added] = process_of.try_emplace(warm ? 0 : r.pid, processes.size());
+        if (added) processes.emplace_back();
+        processes[process->second].push_back(std::move(lookup));
+        lookup_count++;
+    }
+    if (!lookup_count) {
+        fprintf(stderr, "insensitive-replay: no lookups to replay among %zu calls\n", calls);
+        return EXIT_FAILURE;
+    }
+
+    size_t total = lookup_count * times;
+    size_t results_size = sizeof(Results) + total * sizeof(uint64_t);
+    Results* results = static_cast<Results*>(mmap(nullptr, results_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (results == MAP_FAILED) {
+        perror("insensitive-replay: mmap");
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t first = 0;
+    for (long time = 0; time < times; time++) {
+        for (const std::vector<Lookup>& lookups : processes) {
+            if (warm) {
+                replay(resolve, lookups, first, results);
+            } else {
+                // Each recorded process starts with empty caches of its own
+                pid_t child = fork();
+                if (child < 0) {
+                    perror("insensitive-replay: fork");
+                    return EXIT_FAILURE;
+                }
+                if (child == 0) {
+                    replay(resolve, lookups, first, results);
+                    _exit(EXIT_SUCCESS);
+                }
+                int status;
+                while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+                }
+            }
+            first += lookups.size();
+        }
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint64_t> latency(results->latency_ns, results->latency_ns + total);
+    std::sort(latency.begin(), latency.end());
+    uint64_t resolving = 0;
+    for (uint64_t ns : latency) resolving += ns;
+    auto percentile = [&](double fraction) {
+        return static_cast<unsigned long long>(latency[std::min(total - 1, size_t(fraction * total))]);
+    };
+
+    printf("calls:       %zu, %zu looked up in %zu %s, %zu skipped\n", calls, lookup_count,
+           warm ? size_t(1) : processes.size(), warm ? "process" : "processes", skipped);
+    printf("lookups:     %zu in %.3f s resolving, %.0f per second, %.3f s in all\n", total, resolving / 1e9,
+           resolving ? total / (resolving / 1e9) : 0.0, wall);
+    printf("latency ns:  p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n", percentile(0.5), percentile(0.9),
+           percentile(0.99), percentile(0.999), static_cast<unsigned long long>(latency.back()));
+    printf("mismatches:  %llu\n", static_cast<unsigned long long>(results->mismatches));
+    return EXIT_SUCCESS;
+}
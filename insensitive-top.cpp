@@ -0,0 +1,249 @@
+// Watch the processes of a build preloaded with libinsensitive.so, with
+// INSENSITIVE_MONITOR=1 set for the make, ninja or cmake wrappers
+// clang++ -O3 -std=c++20 insensitive-top.cpp -o insensitive-top
+//
+// Usage: insensitive-top [-d seconds] [-n refreshes] [-p processes] [session]
+//
+// Without a session, the most recently started one is shown. The monitor only
+// reads the counters that the processes publish, so it never slows them down.
+
+#include "monitor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct Sample {
+    uint64_t counters[Stats::COUNTER_COUNT] = {};
+};
+
+struct ProcessSample {
+    int32_t pid;
+    std::string program;
+    uint64_t start_time;
+    Sample sample;
+};
+
+// Lookups of a sample, by how they were resolved
+static uint64_t lookups(const Sample& s) {
+    return s.counters[Stats::EXACT_HITS] + s.counters[Stats::CACHE_HITS] + s.counters[Stats::INDEX_HITS] +
+           s.counters[Stats::NEGATIVE_HITS] + s.counters[Stats::RESOLVED] + s.counters[Stats::UNRESOLVED];
+}
+
+static uint64_t hits(const Sample& s) {
+    return s.counters[Stats::EXACT_HITS] + s.counters[Stats::CACHE_HITS] + s.counters[Stats::INDEX_HITS] +
+           s.counters[Stats::NEGATIVE_HITS];
+}
+
+static Sample difference(const Sample& now, const Sample& before) {
+    Sample d;
+    for (int c = 0; c < Stats::COUNTER_COUNT; c++) {
+        // Counts move from a process to the totals when it exits
+        d.counters[c] = now.counters[c] > before.counters[c] ? now.counters[c] - before.counters[c] : 0;
+    }
+    return d;
+}
+
+static std::string format_ns(double ns) {
+    char text[32];
+    if (ns >= 1e9) snprintf(text, sizeof(text), "%.1fs", ns / 1e9);
+    else if (ns >= 1e6) snprintf(text, sizeof(text), "%.1fms", ns / 1e6);
+    else if (ns >= 1e3) snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+    else snprintf(text, sizeof(text), "%.0fns", ns);
+    return text;
+}
+
+static std::string format_ratio(uint64_t part, uint64_t whole) {
+    if (!whole) return "-";
+    char text[16];
+    snprintf(text, sizeof(text), "%.1f%%", 100.0 * part / whole);
+    return text;
+}
+
+// The session whose monitor was created last
+static std::string latest_session() {
+    std::string latest;
+    struct timespec latest_time = {};
+    DIR* d = opendir("/dev/shm");
+    if (!d) return latest;
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.rfind("insensitive-", 0) != 0 || name.size() <= 16 || name.compare(name.size() - 4, 4, ".top") != 0) {
+            continue;
+        }
+        struct stat st;
+        if (stat(("/dev/shm/" + name).c_str(), &st) != 0) continue;
+        if (latest.empty() || st.st_ctim.tv_sec > latest_time.tv_sec ||
+            (st.st_ctim.tv_sec == latest_time.tv_sec && st.st_ctim.tv_nsec > latest_time.tv_nsec)) {
+            latest = name.substr(12, name.size() - 16);
+            latest_time = st.st_ctim;
+        }
+    }
+    closedir(d);
+    return latest;
+}
+
+static void read_counters(const std::atomic<uint64_t>* counters, Sample& s) {
+    for (int c = 0; c < Stats::COUNTER_COUNT; c++) s.counters[c] = counters[c].load(std::memory_order_relaxed);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: insensitive-top [-d seconds] [-n refreshes] [-p processes] [session]\n");
+}
+
+int main(int argc, char* argv[]) {
+    double interval = 1.0;
+    long refreshes = -1;
+    size_t shown = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:p:h")) != -1) {
+        switch (opt) {
+        case 'd': interval = atof(optarg); break;
+        case 'n': refreshes = atol(optarg); break;
+        case 'p': shown = atol(optarg); break;
+        default: usage(); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 < argc || interval <= 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::string session = optind < argc ? argv[optind] : "";
+    if (session.empty()) {
+        const char* current = getenv("INSENSITIVE_SESSION");
+        session = current && *current ? current : latest_session();
+    }
+    if (session.empty()) {
+        fprintf(stderr, "insensitive-top: no build session found, is INSENSITIVE_MONITOR=1 set for the build?\n");
+        return EXIT_FAILURE;
+    }
+
+    std::string path = "/dev/shm/insensitive-" + session + ".top";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "insensitive-top: cannot open '%s': %s\n", path.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+    Monitor monitor;
+    struct stat st;
+    bool attached = fstat(fd, &st) == 0 && size_t(st.st_size) >= Monitor::mapping_size && monitor.attach(fd, false);
+    close(fd);
+    if (!attached) {
+        fprintf(stderr, "insensitive-top: '%s' is not a monitor of this version\n", path.c_str());
+        return EXIT_FAILURE;
+    }
+    const Monitor::Header* header = monitor.data();
+
+    bool terminal = isatty(STDOUT_FILENO);
+    std::map<std::pair<int32_t, uint64_t>, Sample> previous;
+    Sample previous_total;
+    bool first = true;
+    for (long refresh = 0; refreshes < 0 || refresh < refreshes; refresh++) {
+        if (!first) usleep(static_cast<useconds_t>(interval * 1e6));
+
+        // The totals are read before the processes, so that the counts of a
+        // process exiting meanwhile are missed at worst rather than doubled
+        Sample total;
+        read_counters(header->totals, total);
+        uint64_t exited = header->exited.load(std::memory_order_relaxed);
+
+        std::vector<ProcessSample> processes;
+        for (const Monitor::Process& p : header->processes) {
+            int32_t pid = p.pid.load(std::memory_order_acquire);
+            if (!pid) continue;
+            ProcessSample ps{pid, std::string(p.program, strnlen(p.program, sizeof(p.program))),
+                             p.start_time.load(std::memory_order_acquire), {}};
+            read_counters(p.counters, ps.sample);
+            for (int c = 0; c < Stats::COUNTER_COUNT; c++) total.counters[c] += ps.sample.counters[c];
+            // Processes that end with _exit() or a signal keep their slots
+            // until another process needs one
+            if (Monitor::alive(pid)) {
+                processes.push_back(std::move(ps));
+            } else {
+                exited++;
+            }
+        }
+
+        Sample rate = difference(total, previous_total);
+        std::map<std::pair<int32_t, uint64_t>, Sample> current;
+        std::vector<std::pair<Sample, const ProcessSample*>> rates;
+        for (const ProcessSample& ps : processes) {
+            auto key = std::make_pair(ps.pid, ps.start_time);
+            auto before = previous.find(key);
+            rates.emplace_back(before == previous.end() ? ps.sample : difference(ps.sample, before->second), &ps);
+            current[key] = ps.sample;
+        }
+        previous = std::move(current);
+        previous_total = total;
+        if (first) {
+            // Rates need two samples
+            first = false;
+            refresh--;
+            continue;
+        }
+
+        std::sort(rates.begin(), rates.end(), [](const auto& a, const auto& b) {
+            return a.first.counters[Stats::CALL_NS] > b.first.counters[Stats::CALL_NS];
+        });
+
+        if (terminal) printf("\033[H\033[2J");
+        printf("insensitive-top: session %s, %zu running, %llu finished\n\n", session.c_str(), processes.size(),
+               static_cast<unsigned long long>(exited));
+        printf("%-10s %12s %12s %9s %10s %12s %12s\n", "", "calls/s", "lookups/s", "hits", "scans/s",
+               "resolving/s", "in calls/s");
+        auto row = [&](const char* name, const Sample& s, double seconds) {
+            printf("%-10s %12.0f %12.0f %9s %10.0f %12s %12s\n", name, s.counters[Stats::CALLS] / seconds,
+                   lookups(s) / seconds, format_ratio(hits(s), lookups(s)).c_str(),
+                   s.counters[Stats::DIR_SCANS] / seconds, format_ns(s.counters[Stats::RESOLVE_NS] / seconds).c_str(),
+                   format_ns(s.counters[Stats::CALL_NS] / seconds).c_str());
+        };
+        row("now", rate, interval);
+        printf("%-10s %12llu %12llu %9s %10llu %12s %12s\n", "total",
+               static_cast<unsigned long long>(total.counters[Stats::CALLS]),
+               static_cast<unsigned long long>(lookups(total)), format_ratio(hits(total), lookups(total)).c_str(),
+               static_cast<unsigned long long>(total.counters[Stats::DIR_SCANS]),
+               format_ns(total.counters[Stats::RESOLVE_NS]).c_str(),
+               format_ns(total.counters[Stats::CALL_NS]).c_str());
+
+        printf("\n%7s %-16s %10s %10s %8s %8s %11s %10s\n", "pid", "program", "calls/s", "calls", "hits", "scans/s",
+               "resolving/s", "resolving");
+        for (size_t i = 0; i < rates.size() && i < shown; i++) {
+            const Sample& r = rates[i].first;
+            const ProcessSample& ps = *rates[i].second;
+            printf("%7d %-16.16s %10.0f %10llu %8s %8.0f %11s %10s\n", ps.pid, ps.program.c_str(),
+                   r.counters[Stats::CALLS] / interval,
+                   static_cast<unsigned long long>(ps.sample.counters[Stats::CALLS]),
+                   format_ratio(hits(ps.sample), lookups(ps.sample)).c_str(), r.counters[Stats::DIR_SCANS] / interval,
+                   format_ns(r.counters[Stats::RESOLVE_NS] / interval).c_str(),
+                   format_ns(ps.sample.counters[Stats::RESOLVE_NS]).c_str());
+        }
+
+        // The paths are only added to, so a slot is complete once its length is set
+        std::vector<std::pair<uint64_t, std::string>> paths;
+        for (const Monitor::Path& p : header->paths) {
+            uint32_t length = p.length.load(std::memory_order_acquire);
+            if (!length) continue;
+            paths.emplace_back(p.count.load(std::memory_order_relaxed), std::string(p.path, length));
+        }
+        size_t top = std::min<size_t>(paths.size(), 10);
+        std::partial_sort(paths.begin(), paths.begin() + top, paths.end(),
+                          [](const auto& a, const auto& b) { return a.first > b.first; });
+        printf("\n%10s  %s\n", "requests", "top miscased paths");
+        for (size_t i = 0; i < top; i++) {
+            printf("%10llu  %s\n", static_cast<unsigned long long>(paths[i].first), paths[i].second.c_str());
+        }
+        fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,37 +1,96 @@
 // A shared library to intercept file access calls and make filenames case-insensitive
-// clang++-20 -g -O0 -std=c++17 -fPIC insensitive.cpp -shared -o libinsensitive.so
+// clang++-20 -g -O0 -std=c++20 -fPIC insensitive.cpp -shared -o libinsensitive.so
+//
+// Add -DINSENSITIVE_LOG_LEVEL=-1 to compile all logging out of a release build,
+// and -fno-exceptions -fno-rtti -static-libstdc++ -static-libgcc
+// -Wl,--exclude-libs,ALL to load no C++ runtime into every preloaded process
+
+#include "casefold_index.h"
+#include "concurrent_map.h"
+#include "log_ring.h"
+#include "monitor.h"
+#include "probes.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <iostream>
-#include <sstream>
+#include <fnmatch.h>
+#include <glob.h>
 #include <string>
 #include <algorithm>
 #include <memory>
 #include <vector>
 #include <cstdarg>
 #include <cstring>
-#include <filesystem>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <system_error>
+#include <limits.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
-#include <iomanip>
+#include <atomic>
+#include <string_view>
+#include <charconv>
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <type_traits>
+#include <sys/uio.h>
 
-namespace fs = std::filesystem;
+// Messages above this level are compiled out, along with the evaluation of
+// their arguments: -1 drops all logging, 4 keeps TRACE
+#ifndef INSENSITIVE_LOG_LEVEL
+#define INSENSITIVE_LOG_LEVEL 4
+#endif
 
-// Debug logging system
+// Debug logging system. A message is formatted by the calling thread into a
+// ring of its own, without taking a lock or making a syscall, and written out
+// with its timestamp by a background thread. The rings are also drained when
+// one fills up, at exit and on fatal signals
 class DebugLogger {
 private:
     bool enabled;
     int level;
-    std::mutex log_mutex;
     FILE* log_file;
+    // Duplicate of the log file's descriptor, which stays open when the
+    // program closes stderr before the records are written out at exit
+    int log_fd = -1;
+
+    enum WriterState {
+        WRITER_NONE,     // not started yet
+        WRITER_STARTING,
+        WRITER_RUNNING,
+        WRITER_STOPPED   // callers write out their records themselves
+    };
+
+    std::atomic<LogRing*> rings{nullptr};
+    pthread_key_t ring_key;
+    std::atomic<int> writer_state{WRITER_NONE};
+    std::atomic<bool> writer_stopping{false};
+    std::atomic<bool> writer_woken{false};
+    pthread_t writer;
+    sem_t writer_wakeup;
+    pid_t pid;
+    std::atomic<long> utc_offset{0};
 
-    // Helper method to get level as string
-    static std::string getLevelString(int level) {
+    // Held by whoever drains the rings, which owns the buffers below
+    std::atomic<bool> draining{false};
+    char text[LogRing::max_text];
+    char output[64 * 1024];
+    size_t output_size = 0;
+
+    // A process has a single logger, which the exit, fork and signal
+    // handlers reach through this
+    static inline DebugLogger* instance = nullptr;
+    static inline thread_local LogRing* thread_ring = nullptr;
+
+    static const char* getLevelString(int level) {
         switch (level) {
             case ERROR: return "ERROR";
             case WARNING: return "WARNING";
@@ -42,37 +101,288 @@ private:
         }
     }
 
-    // Helper to write log prefix to stream
-    void writeLogPrefix(std::ostringstream& oss, int msg_level) {
-        // Print timestamp, pid, and level prefix
+    // Message text being formatted on the stack of the caller
+    struct Text {
+        char* data;
+        size_t size;
+        size_t capacity;
+
+        void append(const char* s, size_t n) {
+            n = std::min(n, capacity - size);
+            memcpy(data + size, s, n);
+            size += n;
+        }
+    };
+
+    template<typename T>
+    static void append(Text& text, const T& value) {
+        using Value = std::decay_t<T>;
+        if constexpr (std::is_array_v<T>) {
+            text.append(value, strnlen(value, std::extent_v<T>));
+        } else if constexpr (std::is_same_v<Value, const char*> || std::is_same_v<Value, char*>) {
+            const char* s = value ? value : "(null)";
+            text.append(s, strlen(s));
+        } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            std::string_view s = value;
+            text.append(s.data(), s.size());
+        } else if constexpr (std::is_same_v<Value, bool>) {
+            text.append(value ? "1" : "0", 1);
+        } else if constexpr (std::is_same_v<Value, char>) {
+            text.append(&value, 1);
+        } else if constexpr (std::is_integral_v<Value>) {
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value);
+            text.append(digits, result.ptr - digits);
+        } else if constexpr (std::is_pointer_v<Value>) {
+            char digits[24] = "0x";
+            auto result = std::to_chars(digits + 2, digits + sizeof(digits), reinterpret_cast<uintptr_t>(value), 16);
+            text.append(digits, result.ptr - digits);
+        } else {
+            static_assert(sizeof(T) == 0, "no formatting for this type");
+        }
+    }
+
+    template<typename... Args>
+    void log(int msg_level, const Args&... args) {
+        char buffer[LogRing::max_text];
+        Text message{buffer, 0, sizeof(buffer)};
+        (append(message, args), ...);
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t time = uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+
+        LogRing* ring = this_ring();
+        if (!ring) return;
+        if (writer_state.load(std::memory_order_acquire) == WRITER_NONE) start_writer();
+
+        while (!ring->push(time, msg_level, message.data, message.size)) {
+            // The ring is full: wait for the writer, or drain it here
+            if (writer_state.load(std::memory_order_acquire) == WRITER_RUNNING) {
+                wake_writer();
+                sched_yield();
+            } else {
+                drain(true);
+            }
+        }
+        if (writer_state.load(std::memory_order_acquire) != WRITER_RUNNING) {
+            drain(true);
+        } else if (ring->used() > LogRing::capacity / 4) {
+            wake_writer();
+        }
+    }
+
+    LogRing* this_ring() {
+        if (thread_ring) return thread_ring;
+        for (LogRing* ring = rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+            bool expected = false;
+            if (ring->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                thread_ring = ring;
+                break;
+            }
+        }
+        if (!thread_ring) {
+            LogRing* ring = new (std::nothrow) LogRing;
+            if (!ring) return nullptr;
+            ring->owned.store(true, std::memory_order_relaxed);
+            ring->next = rings.load(std::memory_order_relaxed);
+            while (!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+            }
+            thread_ring = ring;
+        }
+        pthread_setspecific(ring_key, thread_ring);
+        return thread_ring;
+    }
+
+    // Hand the ring of an exiting thread over to later threads, with the
+    // records it still holds
+    static void release_ring(void* ring) {
+        static_cast<LogRing*>(ring)->owned.store(false, std::memory_order_release);
+    }
+
+    void start_writer() {
+        int expected = WRITER_NONE;
+        if (!writer_state.compare_exchange_strong(expected, WRITER_STARTING)) return;
+
+        // Keep the signals of the process away from the writer
+        sigset_t all, previous;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &previous);
+        bool started = pthread_create(&writer, nullptr, writer_main, this) == 0;
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+        writer_state.store(started ? WRITER_RUNNING : WRITER_STOPPED, std::memory_order_release);
+    }
+
+    void wake_writer() {
+        if (!writer_woken.exchange(true, std::memory_order_relaxed)) sem_post(&writer_wakeup);
+    }
+
+    static void* writer_main(void* arg) {
+        DebugLogger* logger = static_cast<DebugLogger*>(arg);
+        while (!logger->writer_stopping.load(std::memory_order_acquire)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 50000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            sem_timedwait(&logger->writer_wakeup, &deadline);
+            logger->writer_woken.store(false, std::memory_order_relaxed);
+            logger->update_utc_offset();
+            logger->drain(true);
+        }
+        return nullptr;
+    }
+
+    // Not called from signal handlers, since localtime_r() may take a lock
+    void update_utc_offset() {
         time_t now = time(nullptr);
         struct tm timeinfo;
-        localtime_r(&now, &timeinfo);
-        
-        oss << "[" 
-            << std::put_time(&timeinfo, "%Y-%m-%d %H:%M:%S") 
-            << "][" << getpid() << "]["
-            << getLevelString(msg_level) << "] ";
+        if (localtime_r(&now, &timeinfo)) utc_offset.store(timeinfo.tm_gmtoff, std::memory_order_relaxed);
     }
 
-    // Internal log writer that takes a stringstream
-    void writeLogMessage(int msg_level, const std::string& message) {
-        if (!enabled || msg_level > level) return;
+    // Write out the records of all rings, oldest first. Returns false if
+    // another thread is draining them and `wait` is false or it takes too long
+    bool drain(bool wait) {
+        for (int spins = 0; draining.exchange(true, std::memory_order_acquire); spins++) {
+            if (!wait || spins > 100000) return false;
+            sched_yield();
+        }
 
-        std::lock_guard<std::mutex> lock(log_mutex);
-        
-        std::ostringstream oss;
-        writeLogPrefix(oss, msg_level);
-        oss << message;
+        LogRing::Record record;
+        for (;;) {
+            LogRing* oldest = nullptr;
+            uint64_t oldest_time = 0;
+            for (LogRing* ring = rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+                if (ring->front(record) && (!oldest || record.time < oldest_time)) {
+                    oldest = ring;
+                    oldest_time = record.time;
+                }
+            }
+            if (!oldest) break;
+            oldest->front(record);
+            oldest->pop(record, text);
+            format_line(record);
+        }
+        flush_output();
+
+        draining.store(false, std::memory_order_release);
+        return true;
+    }
+
+    // Format a record as "[2024-01-31 12:00:00][pid][LEVEL] text" without
+    // calling into libc, so that it can also run in a signal handler
+    void format_line(const LogRing::Record& record) {
+        if (sizeof(output) - output_size < LogRing::max_text + 64) flush_output();
 
+        int64_t seconds = record.time / 1000000000 + utc_offset.load(std::memory_order_relaxed);
+        int64_t days = seconds / 86400;
+        int64_t second_of_day = seconds % 86400;
+        // Civil date from days since 1970-01-01
+        int64_t shifted = days + 719468;
+        int64_t era = shifted / 146097;
+        int64_t day_of_era = shifted - era * 146097;
+        int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+        int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+        int64_t month_index = (5 * day_of_year + 2) / 153;
+        int64_t day = day_of_year - (153 * month_index + 2) / 5 + 1;
+        int64_t month = month_index < 10 ? month_index + 3 : month_index - 9;
+        int64_t year = year_of_era + era * 400 + (month <= 2);
+
+        char* out = output + output_size;
+        auto put = [&](const char* s) { while (*s) *out++ = *s++; };
+        auto put_number = [&](int64_t value, int width) {
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value);
+            for (int n = result.ptr - digits; n < width; n++) *out++ = '0';
+            for (char* d = digits; d != result.ptr; d++) *out++ = *d;
+        };
+        put("[");
+        put_number(year, 4);
+        put("-");
+        put_number(month, 2);
+        put("-");
+        put_number(day, 2);
+        put(" ");
+        put_number(second_of_day / 3600, 2);
+        put(":");
+        put_number(second_of_day / 60 % 60, 2);
+        put(":");
+        put_number(second_of_day % 60, 2);
+        put("][");
+        put_number(pid, 0);
+        put("][");
+        put(getLevelString(record.level));
+        put("] ");
+        memcpy(out, text, record.length);
+        out += record.length;
         // Ensure we have a newline
-        std::string output = oss.str();
-        if (!output.empty() && output.back() != '\n') {
-            output += '\n';
+        if (record.length == 0 || text[record.length - 1] != '\n') *out++ = '\n';
+        output_size = out - output;
+    }
+
+    void flush_output() {
+        for (size_t written = 0; written < output_size;) {
+            ssize_t n = write(log_fd, output + written, output_size - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            written += n;
+        }
+        output_size = 0;
+    }
+
+    // Stop the writer and write out what is left. Records logged later, by
+    // other exit handlers or threads still running, are written out by
+    // their callers
+    static void flush_at_exit() {
+        DebugLogger* logger = instance;
+        int saved_errno = errno;
+        if (logger->writer_state.exchange(WRITER_STOPPED) == WRITER_RUNNING) {
+            logger->writer_stopping.store(true, std::memory_order_release);
+            sem_post(&logger->writer_wakeup);
+            pthread_join(logger->writer, nullptr);
+        }
+        logger->drain(true);
+        errno = saved_errno;
+    }
+
+    // Only the thread that called fork() runs in the child, which writes out
+    // its records itself rather than start another thread before a likely
+    // exec(). The records copied from the parent are the parent's to write
+    static void after_fork_in_child() {
+        DebugLogger* logger = instance;
+        logger->pid = getpid();
+        logger->draining.store(false, std::memory_order_relaxed);
+        logger->output_size = 0;
+        logger->writer_state.store(WRITER_STOPPED, std::memory_order_relaxed);
+        for (LogRing* ring = logger->rings.load(std::memory_order_relaxed); ring; ring = ring->next) {
+            ring->clear();
+            if (ring != thread_ring) ring->owned.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    static void flush_on_signal(int sig) {
+        int saved_errno = errno;
+        instance->writer_state.store(WRITER_STOPPED, std::memory_order_relaxed);
+        instance->drain(true);
+        errno = saved_errno;
+        // The handler was reset to the default action, which this delivers
+        raise(sig);
+    }
+
+    // Only where the process keeps the default action, which ends it
+    static void install_signal_handlers() {
+        for (int sig : {SIGHUP, SIGINT, SIGQUIT, SIGILL, SIGABRT, SIGBUS, SIGFPE, SIGSEGV, SIGTERM}) {
+            struct sigaction current;
+            if (sigaction(sig, nullptr, &current) != 0 || current.sa_handler != SIG_DFL) continue;
+            struct sigaction action = {};
+            action.sa_handler = flush_on_signal;
+            action.sa_flags = SA_RESETHAND | SA_NODEFER;
+            sigemptyset(&action.sa_mask);
+            sigaction(sig, &action, nullptr);
         }
-        
-        fputs(output.c_str(), log_file);
-        fflush(log_file);
     }
 
 public:
@@ -84,7 +394,11 @@ public:
         TRACE = 4
     };
 
+    static constexpr int compiled_level = INSENSITIVE_LOG_LEVEL;
+
     DebugLogger() : enabled(false), level(ERROR), log_file(stderr) {
+        if constexpr (compiled_level < ERROR) return;
+
         // Check environment variable to enable logging
         const char* env_debug = getenv("INSENSITIVE_DEBUG");
         if (env_debug && (strcmp(env_debug, "1") == 0 || 
@@ -111,6 +425,19 @@ public:
                 fprintf(stderr, "Warning: Could not open debug log file '%s', using stderr\n", env_file);
             }
         }
+
+        if (enabled) {
+            instance = this;
+            log_fd = fcntl(fileno(log_file), F_DUPFD_CLOEXEC, 3);
+            if (log_fd < 0) log_fd = fileno(log_file);
+            pid = getpid();
+            update_utc_offset();
+            sem_init(&writer_wakeup, 0, 0);
+            pthread_key_create(&ring_key, release_ring);
+            atexit(flush_at_exit);
+            pthread_atfork(nullptr, nullptr, after_fork_in_child);
+            install_signal_handlers();
+        }
     }
 
     ~DebugLogger() {
@@ -127,349 +454,2217 @@ public:
         return level;
     }
 
+    // Constant false for the levels compiled out, so that callers can skip
+    // preparing what they would log
+    bool isEnabledFor(int msg_level) const {
+        return msg_level <= compiled_level && enabled && msg_level <= level;
+    }
+
     // Stream-based logging methods
     template<typename... Args>
     void error(const Args&... args) {
-        if (!enabled || ERROR > level) return;
-        std::ostringstream oss;
-        (oss << ... << args);
-        writeLogMessage(ERROR, oss.str());
+        if constexpr (ERROR <= compiled_level) {
+            if (!enabled || ERROR > level) return;
+            log(ERROR, args...);
+        }
     }
     
     template<typename... Args>
     void warning(const Args&... args) {
-        if (!enabled || WARNING > level) return;
-        std::ostringstream oss;
-        (oss << ... << args);
-        writeLogMessage(WARNING, oss.str());
+        if constexpr (WARNING <= compiled_level) {
+            if (!enabled || WARNING > level) return;
+            log(WARNING, args...);
+        }
     }
     
     template<typename... Args>
     void info(const Args&... args) {
-        if (!enabled || INFO > level) return;
-        std::ostringstream oss;
-        (oss << ... << args);
-        writeLogMessage(INFO, oss.str());
+        if constexpr (INFO <= compiled_level) {
+            if (!enabled || INFO > level) return;
+            log(INFO, args...);
+        }
     }
     
     template<typename... Args>
     void debug(const Args&... args) {
-        if (!enabled || DEBUG > level) return;
-        std::ostringstream oss;
-        (oss << ... << args);
-        writeLogMessage(DEBUG, oss.str());
+        if constexpr (DEBUG <= compiled_level) {
+            if (!enabled || DEBUG > level) return;
+            log(DEBUG, args...);
+        }
     }
     
     template<typename... Args>
     void trace(const Args&... args) {
-        if (!enabled || TRACE > level) return;
-        std::ostringstream oss;
-        (oss << ... << args);
-        writeLogMessage(TRACE, oss.str());
+        if constexpr (TRACE <= compiled_level) {
+            if (!enabled || TRACE > level) return;
+            log(TRACE, args...);
+        }
     }
 };
 
+// Versioned stat functions that stat() called before glibc 2.33, which
+// binaries built against older glibc still call directly. Newer glibc
+// keeps exporting them without declaring them
+extern "C" {
+int __xstat(int ver, const char* path, struct stat* buf);
+int __lxstat(int ver, const char* path, struct stat* buf);
+int __fxstatat(int ver, int dirfd, const char* path, struct stat* buf, int flags);
+int __xstat64(int ver, const char* path, struct stat64* buf);
+int __lxstat64(int ver, const char* path, struct stat64* buf);
+int __fxstatat64(int ver, int dirfd, const char* path, struct stat64* buf, int flags);
+}
+
 #define DEF(func) decltype(&func) func##_real
 #define STR(x) #x
 #define BIND(func) func##_real = getFunctionPointer<decltype(&func)>(STR(func))
 
-// Add a cache and a mutex for thread safety
-class Wrapper {
-    std::unordered_map<std::string, std::string> cache;
-    std::mutex cache_mutex;
+// Resolution cache shared by all processes of a build session through a
+// file in /dev/shm. Entries are only ever added, so no locks are needed:
+// a writer claims a slot with a CAS on its hash, appends the key and the
+// value to the arena, and publishes them by storing their offset last
+class SharedCache {
+    static constexpr uint32_t magic = 0x494e5331; // "INS1"
+    static constexpr uint32_t slot_count = 1 << 16;
+    static constexpr uint32_t arena_size = 16 << 20;
+    static constexpr uint32_t max_probes = 64;
 
-    template<typename T>
-    T getFunctionPointer(const char* name) {
-        logger.debug("Getting function pointer for ", name);
-        T func = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
-        if (!func) {
-            logger.error("Could not find original function ", name, ": ", dlerror());
-        }
-        return func;
-    }
+    struct Slot {
+        std::atomic<uint64_t> hash;   // 0 for a free slot
+        std::atomic<uint32_t> offset; // arena offset + 1, 0 until published
+        uint16_t key_length;
+        uint16_t value_length;
+    };
 
-    static std::unique_ptr<char[]> clone(const char* source) {
-        if (!source) {
-            return nullptr;
-        }
+    struct Header {
+        std::atomic<uint32_t> magic;
+        std::atomic<uint32_t> arena_used;
+        Slot slots[slot_count];
+    };
 
-        size_t length = std::strlen(source) + 1;
-        std::unique_ptr<char[]> cloned(new char[length]);
-        std::strcpy(cloned.get(), source);
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared cache needs lock-free atomics");
 
-        return cloned;
-    }
+    static constexpr size_t mapping_size = sizeof(Header) + arena_size;
 
-    // Check if a path should be excluded from case-insensitive handling
-    bool should_exclude_path(const char* path) {
-        if (!path) return false;
-        
-        // List of paths to exclude from case-insensitive handling
-        static const std::vector<std::string> excluded_prefixes = {
-            "/dev/",
-            "/proc/",
-            "/sys/"
-        };
-        
-        for (const auto& prefix : excluded_prefixes) {
-            if (strncmp(path, prefix.c_str(), prefix.length()) == 0) {
-                logger.trace("Path '", path, "' excluded from case-insensitive handling");
-                return true;
-            }
+    Header* header = nullptr;
+    char* arena = nullptr;
+
+    // FNV-1a, never 0 so that it can't be confused with a free slot
+    static uint64_t hash(std::string_view key) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (unsigned char c : key) {
+            h ^= c;
+            h *= 0x100000001b3ull;
         }
-        
-        return false;
+        return h ? h : 1;
     }
 
-    bool file_exists_real(const char* path) {
-        logger.trace("Checking if file exists: ", path);
-        struct stat st;
-        int result = stat_real(path, &st);
-        logger.trace("File ", path, " exists? ", result == 0 ? "yes" : "no");
-        return result == 0;
+    bool key_equals(const Slot& slot, uint32_t offset, std::string_view key) const {
+        return slot.key_length == key.size() &&
+               memcmp(arena + offset - 1, key.data(), key.size()) == 0;
     }
 
-    std::unique_ptr<char[]> replace_filename_case_insensitive(const char* path) {
-        if (!path) return nullptr;
-        
-        logger.debug("Processing path: ", path);
-        
-        // Skip case-insensitive handling for excluded paths
-        if (should_exclude_path(path)) {
-            logger.debug("Path excluded, returning unchanged: ", path);
-            return clone(path);
-        }
-        
-        fs::path p(path);
-        
-        // If path is empty or root directory, just return it
-        if (p.empty() || p == p.root_path()) {
-            logger.debug("Path is empty or root, returning unchanged: ", path);
-            return clone(path);
-        }
-        
-        // If file exists with exact case, no need to search
-        if (file_exists_real(path)) {
-            logger.debug("File exists with exact case, returning unchanged: ", path);
-            return clone(path);
-        }
-        
-        std::string filename = p.filename().string();
-        std::string lower_filename = filename;
-        std::transform(lower_filename.begin(), lower_filename.end(), lower_filename.begin(), ::tolower);
-        logger.debug("Looking for case-insensitive match for '", filename, "' (lowercase: '", lower_filename, "')");
+public:
+    ~SharedCache() {
+        if (header) munmap(header, mapping_size);
+    }
 
-        // Check cache first
-        {
-            std::lock_guard<std::mutex> lock(cache_mutex);
-            auto it = cache.find(p.string());
-            if (it != cache.end()) {
-                logger.debug("Cache hit: ", p.string(), " -> ", it->second);
-                return clone(it->second.c_str());
-            }
-            logger.trace("Cache miss for ", p.string());
-        }
+    bool attached() const { return header != nullptr; }
 
-        std::unique_ptr<char[]> path_new = clone(path);
-        
-        // Check if parent path exists
-        logger.trace("Checking parent path: ", p.parent_path().c_str());
-        if (!file_exists_real(p.parent_path().c_str())) {
-            logger.debug("Parent path doesn't exist, trying to find it recursively: ", 
-                         p.parent_path().c_str());
-            // Try to find the parent path recursively
-            auto parent_path = replace_filename_case_insensitive(p.parent_path().c_str());
-            if (parent_path) {
-                fs::path new_parent(parent_path.get());
-                if (file_exists_real(new_parent.c_str())) {
-                    logger.debug("Found parent path: ", new_parent.c_str());
-                    p = new_parent / p.filename();
-                } else {
-                    logger.debug("Could not find parent path: ", new_parent.c_str());
-                }
-            }
-        }
+    // Map the session file, which all processes size and initialize the same way
+    bool attach(int fd) {
+        if (ftruncate(fd, mapping_size) != 0) return false;
+        void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) return false;
 
-        // We need to use a different approach to iterate through directories
-        // to avoid calling our intercepted functions
-        try {
-            logger.debug("Opening directory: ", p.parent_path().c_str());
-            DIR* dir = opendir_real(p.parent_path().c_str());
-            if (dir) {
-                struct dirent* entry;
-                while ((entry = readdir(dir)) != nullptr) {
-                    std::string direntry = entry->d_name;
-                    
-                    // Skip . and .. entries
-                    if (direntry == "." || direntry == "..") continue;
-                    
-                    std::string lower_direntry = direntry;
-                    std::transform(lower_direntry.begin(), lower_direntry.end(), lower_direntry.begin(), ::tolower);
-                    
-                    logger.trace("Comparing '", filename, "' (lowercase: '", lower_filename, 
-                                "') with '", direntry, "' (lowercase: '", lower_direntry, "')");
-                    
-                    if (lower_filename == lower_direntry) {
-                        fs::path new_path = p.parent_path() / direntry;
-                        logger.info("Found case-insensitive match: ", path, " -> ", new_path.c_str());
-                        path_new = clone(new_path.c_str());
-
-                        // Update cache
-                        std::lock_guard<std::mutex> lock(cache_mutex);
-                        cache[p.string()] = new_path.string();
-                        break;
-                    }
-                }
-                closedir(dir);
-                
-                if (strcmp(path, path_new.get()) == 0) {
-                    logger.debug("No case-insensitive match found, using original path: ", path);
-                }
-            } else {
-                logger.warning("Could not open directory: ", p.parent_path().c_str());
-            }
-        } catch (const std::exception& e) {
-            logger.error("Exception while searching for case-insensitive match: ", e.what());
-            // Just return the original path if we encounter any errors
+        Header* h = static_cast<Header*>(mapping);
+        uint32_t expected = 0;
+        if (!h->magic.compare_exchange_strong(expected, magic) && expected != magic) {
+            munmap(mapping, mapping_size);
+            return false;
         }
 
-        return path_new;
+        header = h;
+        arena = static_cast<char*>(mapping) + sizeof(Header);
+        return true;
     }
 
-    Wrapper() {
-        // Bind all function pointers to the original functions
-        BIND(open);
-        BIND(open64);
-        BIND(openat);
-        BIND(stat);
-        BIND(lstat);
-        BIND(fstatat);
-        BIND(access);
-        BIND(faccessat);
-        BIND(opendir);
-        BIND(readlink);
-        BIND(readdir);
-        BIND(closedir);
-        
-        logger.info("Initialization complete, debug level: ", logger.getLevel());
-    }
+    // Copy the value of a key into `value` and return its length, or 0 if
+    // the key is missing or the value doesn't fit
+    size_t lookup(std::string_view key, char* value, size_t capacity) const {
+        if (!header) return 0;
 
-public:
+        uint64_t h = hash(key);
+        for (uint32_t i = 0; i < max_probes; i++) {
+            const Slot& slot = header->slots[(h + i) & (slot_count - 1)];
+            uint64_t slot_hash = slot.hash.load(std::memory_order_acquire);
+            if (slot_hash == 0) return 0;
+            if (slot_hash != h) continue;
 
-    // Implementation of wrap_func to handle function calls with logging
-    template<typename Func, typename ReturnType, typename... Args>
-    ReturnType wrap_func(const char* func_name, Func func, Args... args) {
-        auto result = func(args...);
-        logger.debug("EXIT: ", func_name, "() -> ", result);
-        return result;
+            // A claimed but unpublished slot is skipped, it may hold another key
+            uint32_t offset = slot.offset.load(std::memory_order_acquire);
+            if (offset == 0 || !key_equals(slot, offset, key)) continue;
+
+            if (slot.value_length >= capacity) return 0;
+            memcpy(value, arena + offset - 1 + slot.key_length, slot.value_length);
+            return slot.value_length;
+        }
+        return 0;
     }
 
-    // Implementation of case_adjusted_path to handle path adjustment with logging
-    template<typename... Args>
-    std::unique_ptr<char[]> case_adjusted_path(const char* func_name, const char* path) {
-        logger.debug("ENTER: ", func_name, "(", path ? path : "(null)", ")");
-        
-        std::unique_ptr<char[]> adjusted_path = replace_filename_case_insensitive(path);
-        
-        if (path && adjusted_path.get() && strcmp(path, adjusted_path.get()) != 0) {
-            logger.debug("ADJUST: ", func_name, " path ", path, " -> ", adjusted_path.get());
+    void insert(std::string_view key, std::string_view value) {
+        if (!header) return;
+        if (key.size() > UINT16_MAX || value.size() > UINT16_MAX) return;
+
+        uint64_t h = hash(key);
+        for (uint32_t i = 0; i < max_probes; i++) {
+            Slot& slot = header->slots[(h + i) & (slot_count - 1)];
+            uint64_t slot_hash = slot.hash.load(std::memory_order_acquire);
+            if (slot_hash != 0 || !slot.hash.compare_exchange_strong(slot_hash, h, std::memory_order_acq_rel)) {
+                // The slot is taken, possibly by the same key
+                if (slot_hash == h) {
+                    uint32_t offset = slot.offset.load(std::memory_order_acquire);
+                    if (offset != 0 && key_equals(slot, offset, key)) return;
+                }
+                continue;
+            }
+
+            // Once the arena is full, the claimed slot stays unpublished
+            uint32_t length = key.size() + value.size();
+            uint32_t offset = header->arena_used.fetch_add(length, std::memory_order_relaxed);
+            if (offset + length > arena_size) return;
+
+            memcpy(arena + offset, key.data(), key.size());
+            memcpy(arena + offset + key.size(), value.data(), value.size());
+            slot.key_length = key.size();
+            slot.value_length = value.size();
+            slot.offset.store(offset + 1, std::memory_order_release);
+            return;
         }
-        
-        return adjusted_path;
     }
 
-    // Define all function pointers for the functions we'll intercept
-    DEF(open);
-    DEF(open64);
-    DEF(openat);
-    DEF(stat);
-    DEF(lstat);
-    DEF(fstatat);
-    DEF(access);
-    DEF(faccessat);
-    DEF(opendir);
-    DEF(readlink);
-    DEF(readdir);
-    DEF(closedir);
+    // Hide the value of a key from lookups, once it has turned out to be stale.
+    // The slot and the arena space stay taken, and a new value for the key
+    // goes to another slot
+    void erase(std::string_view key) {
+        if (!header) return;
 
-    DebugLogger logger;
+        uint64_t h = hash(key);
+        for (uint32_t i = 0; i < max_probes; i++) {
+            Slot& slot = header->slots[(h + i) & (slot_count - 1)];
+            uint64_t slot_hash = slot.hash.load(std::memory_order_acquire);
+            if (slot_hash == 0) return;
+            if (slot_hash != h) continue;
 
-    static Wrapper& get()
-    {
-        // Do not destroy, since the order of destruction is undetermined.
-        static Wrapper* wrapper = nullptr;
-        if (!wrapper) wrapper = new Wrapper();
-        return *wrapper;
+            uint32_t offset = slot.offset.load(std::memory_order_acquire);
+            if (offset != 0 && key_equals(slot, offset, key)) {
+                slot.offset.compare_exchange_strong(offset, 0, std::memory_order_acq_rel);
+            }
+        }
     }
 };
 
-// Helper macros to make function calls cleaner
-#define WRAP(func, ...) \
-    Wrapper::get().wrap_func<decltype(Wrapper::get().func##_real), decltype(Wrapper::get().func##_real(__VA_ARGS__))>(#func, Wrapper::get().func##_real, __VA_ARGS__)
+// Trie of the directory prefixes under which paths are handled, built from
+// INSENSITIVE_ROOTS and INSENSITIVE_EXCLUDE. Each path is decided by the
+// longest listed prefix it lies under, in any case. Without any roots, all
+// paths that are not excluded are handled
+class PathFilter {
+    enum Rule : uint8_t { NONE, INCLUDE, EXCLUDE };
 
-#define CASE(func, path) \
-    Wrapper::get().case_adjusted_path(#func, path).get()
+    struct Node {
+        std::string name;
+        Rule rule = NONE;
+        std::vector<uint32_t> children;
+    };
 
-int open(const char *path, int flags, ...) {
-    mode_t mode = 0;
-    if (flags & O_CREAT) {
-        va_list args;
-        va_start(args, flags);
-        mode = va_arg(args, mode_t);
-        va_end(args);
+    std::vector<Node> nodes{Node{}};
+    bool has_roots = false;
+
+    // Call `visit` with each component of a path, skipping empty and "."
+    // components. Stops early when `visit` returns false
+    template<typename Visit>
+    static bool for_each_component(std::string_view path, Visit&& visit) {
+        for (size_t begin = 0; begin < path.size(); ) {
+            size_t end = path.find('/', begin);
+            if (end == std::string_view::npos) end = path.size();
+            std::string_view component = path.substr(begin, end - begin);
+            if (!component.empty() && component != "." && !visit(component)) return false;
+            begin = end + 1;
+        }
+        return true;
     }
-    
-    return WRAP(open, CASE(open, path), flags, mode);
-}
 
-int open64(const char *path, int flags, ...) {
-    mode_t mode = 0;
-    if (flags & O_CREAT) {
-        va_list args;
-        va_start(args, flags);
-        mode = va_arg(args, mode_t);
-        va_end(args);
+    void add(std::string_view prefix, Rule rule) {
+        uint32_t node = 0;
+        for_each_component(prefix, [&](std::string_view component) {
+            for (uint32_t child : nodes[node].children) {
+                if (fold_equals(nodes[child].name, component)) {
+                    node = child;
+                    return true;
+                }
+            }
+            nodes.push_back(Node{std::string(component), NONE, {}});
+            nodes[node].children.push_back(nodes.size() - 1);
+            node = nodes.size() - 1;
+            return true;
+        });
+        nodes[node].rule = rule;
     }
-    
-    return WRAP(open64, CASE(open64, path), flags, mode);
-}
 
-int openat(int dirfd, const char *path, int flags, ...) {
-    mode_t mode = 0;
-    if (flags & O_CREAT) {
-        va_list args;
-        va_start(args, flags);
-        mode = va_arg(args, mode_t);
-        va_end(args);
+public:
+    // Add every absolute path of a colon-separated list
+    void add_list(const char* list, bool include) {
+        std::string_view rest(list);
+        while (!rest.empty()) {
+            size_t end = rest.find(':');
+            std::string_view prefix = rest.substr(0, end);
+            if (!prefix.empty() && prefix[0] == '/') {
+                add(prefix, include ? INCLUDE : EXCLUDE);
+                has_roots = has_roots || include;
+            }
+            rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+        }
     }
-    
-    return WRAP(openat, dirfd, CASE(openat, path), flags, mode);
-}
 
-int stat(const char *path, struct stat *buf) {
-    return WRAP(stat, CASE(stat, path), buf);
-}
+    // Whether relative paths depend on the directory they are relative to
+    bool restricted() const { return has_roots; }
 
-int lstat(const char *path, struct stat *buf) {
-    return WRAP(lstat, CASE(lstat, path), buf);
-}
+    // Decide on the path `dir`/`path`, where `dir` is absolute. Paths with
+    // ".." components are always handled, since their prefix can't be known
+    // without resolving them
+    bool handles(std::string_view dir, std::string_view path) const {
+        uint32_t node = 0;
+        Rule rule = has_roots ? EXCLUDE : INCLUDE;
+        bool known = true;
+        auto step = [&](std::string_view component) {
+            if (component == "..") {
+                known = false;
+                return false;
+            }
+            for (uint32_t child : nodes[node].children) {
+                if (fold_equals(nodes[child].name, component)) {
+                    node = child;
+                    if (nodes[node].rule != NONE) rule = nodes[node].rule;
+                    return true;
+                }
+            }
+            return false;
+        };
+        if (for_each_component(dir, step)) for_each_component(path, step);
+        return !known || rule == INCLUDE;
+    }
+};
 
-int fstatat(int dirfd, const char *path, struct stat *buf, int flags) {
-    return WRAP(fstatat, dirfd, CASE(fstatat, path), buf, flags);
+// Match a program name against a pattern with * and ? wildcards
+static bool match_program(std::string_view pattern, std::string_view name) {
+    size_t p = 0, n = 0;
+    size_t star = std::string_view::npos, resume = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (star != std::string_view::npos) {
+            // Let the last * take one more character
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
 }
 
-int access(const char *path, int mode) {
-    return WRAP(access, CASE(access, path), mode);
+// Decide on a process from the colon-separated patterns of `list`, matched
+// against the file names of its executable and of its argv[0]: the process is
+// handled unless a pattern prefixed with ! matches, and if there are patterns
+// without !, only if one of them matches
+static bool handles_program(std::string_view list, std::string_view exe, std::string_view argv0) {
+    auto base = [](std::string_view path) {
+        size_t slash = path.rfind('/');
+        return slash == std::string_view::npos ? path : path.substr(slash + 1);
+    };
+    exe = base(exe);
+    argv0 = base(argv0);
+    bool allowed = false, has_allowed = false;
+    while (!list.empty()) {
+        size_t end = list.find(':');
+        std::string_view pattern = list.substr(0, end);
+        list = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+        bool denied = !pattern.empty() && pattern[0] == '!';
+        if (denied) pattern.remove_prefix(1);
+        if (pattern.empty()) continue;
+        bool matched = (!exe.empty() && match_program(pattern, exe)) || (!argv0.empty() && match_program(pattern, argv0));
+        if (denied && matched) return false;
+        if (!denied) {
+            has_allowed = true;
+            allowed = allowed || matched;
+        }
+    }
+    return allowed || !has_allowed;
 }
 
-int faccessat(int dirfd, const char *path, int mode, int flags) {
-    return WRAP(faccessat, dirfd, CASE(faccessat, path), mode, flags);
-}
+// Add a cache and a mutex for thread safety
+class Wrapper {
+    // Listing of a directory, built on its first scan and rebuilt whenever
+    // the directory's mtime changes. Names are looked up in any case through
+    // views of the entries, which stay in place once the index is built
+    struct DirIndex {
+        struct Entry {
+            std::string name;
+            ino_t ino;
+            unsigned char type; // DT_*
+        };
 
-DIR *opendir(const char *path) {
-    return WRAP(opendir, CASE(opendir, path));
-}
+        struct timespec mtime;
+        ino_t ino = 0, parent_ino = 0; // of "." and ".."
+        std::vector<Entry> entries;
+        std::unordered_set<std::string_view, FoldHash, FoldEqual> names;
 
-ssize_t readlink(const char *path, char *buf, size_t bufsiz) {
-    return WRAP(readlink, CASE(readlink, path), buf, bufsiz);
-}
+        DirIndex() = default;
+        DirIndex(DirIndex&&) = default;
+        DirIndex& operator=(DirIndex&&) = default;
+    };
+
+    // Copy of a directory index that glob() and scandir() read in place of
+    // the directory itself
+    struct DirListing {
+        ino_t ino, parent_ino;
+        std::vector<DirIndex::Entry> entries;
+        size_t next = 0; // "." and ".." come first
+        struct dirent64 current;
+    };
+
+    // Per-thread buffer that directories are read into with getdents64,
+    // large enough for most directories to take a single call
+    static constexpr size_t scan_buffer_size = 64 << 10;
+    static inline thread_local char* scan_buffer = nullptr;
+    pthread_key_t scan_buffer_key;
+
+    // Directories are identified by device and inode, so that every path
+    // leading to the same directory shares one index
+    struct DirKey {
+        dev_t dev;
+        ino_t ino;
+        bool operator==(const DirKey& other) const { return dev == other.dev && ino == other.ino; }
+    };
+
+    struct DirKeyHash {
+        size_t operator()(const DirKey& key) const {
+            return std::hash<ino_t>()(key.ino) ^ (std::hash<dev_t>()(key.dev) << 1);
+        }
+    };
+
+    std::unordered_map<DirKey, DirIndex, DirKeyHash> dir_indexes;
+    std::mutex dir_index_mutex;
+
+    // Paths are cached together with the identity of the directory they are
+    // relative to, i.e. the dirfd of an *at() call or the current directory,
+    // so that entries stay valid across chdir. Absolute paths have a null base
+    struct PathKey {
+        DirKey base;
+        std::string path;
+    };
+
+    // Lookups use a view of the caller's path, to avoid copying it
+    struct PathKeyView {
+        DirKey base;
+        std::string_view path;
+    };
+
+    struct PathKeyHash {
+        using is_transparent = void;
+        size_t operator()(const PathKeyView& key) const {
+            return std::hash<std::string_view>()(key.path) ^ (DirKeyHash()(key.base) << 1);
+        }
+        size_t operator()(const PathKey& key) const { return (*this)(PathKeyView{key.base, key.path}); }
+    };
+
+    struct PathKeyEqual {
+        using is_transparent = void;
+        template<typename A, typename B>
+        bool operator()(const A& a, const B& b) const {
+            return a.base == b.base && std::string_view(a.path) == std::string_view(b.path);
+        }
+    };
+
+    // Protects the readers of the maps below, which take no locks
+    EpochDomain epochs;
+
+    ConcurrentMap<PathKey, std::string, PathKeyHash, PathKeyEqual> cache{epochs};
+
+    // Per-thread copies of recent cache hits, served without touching any
+    // memory shared with other threads. An entry is valid as long as no
+    // cache entry has been replaced or erased since it was copied
+    struct RecentHits {
+        struct Entry {
+            uint64_t generation; // of the cache, 0 for an empty entry
+            size_t hash;
+            DirKey base;
+            uint16_t path_length;
+            uint16_t value_length;
+            char data[480]; // path, then value with a terminating null
+        };
+        Entry entries[64];
+    };
+
+    static inline thread_local RecentHits* recent_hits = nullptr;
+    pthread_key_t recent_hits_key;
+
+    // A path that does not exist in any case. The lookup failed because the
+    // directory it ended in had no matching entry; as long as that directory
+    // keeps its mtime and this process creates nothing in it, the lookup
+    // would fail again. The directory path is relative to the same base as
+    // the path itself
+    struct NegativeEntry {
+        std::string dir;
+        DirKey key{0, 0};
+        struct timespec mtime;
+        uint64_t creations = 0; // by this process when the lookup started
+    };
+
+    ConcurrentMap<PathKey, NegativeEntry, PathKeyHash, PathKeyEqual> negative_cache{epochs};
+
+    // Entries created by this process, counted, and the count at the latest
+    // creation in each directory. The mtime of a directory may not change
+    // with coarse timestamps, so misses are checked against these too
+    std::atomic<uint64_t> creations{0};
+    ConcurrentMap<DirKey, uint64_t, DirKeyHash, std::equal_to<DirKey>> created_in{epochs};
+
+    // Directory that a path prefix resolves to, such as /opt/xwin/SDK/Include
+    // to /opt/xwin/sdk/include. Exact prefixes resolve to themselves
+    struct ResolvedDir {
+        std::string path;
+        DirKey key;
+    };
+
+    ConcurrentMap<PathKey, ResolvedDir, PathKeyHash, PathKeyEqual> prefixes{epochs};
+
+    // Directories selected by INSENSITIVE_ROOTS and INSENSITIVE_EXCLUDE
+    PathFilter filter;
+
+    // Identity of the current directory, the base of most relative paths.
+    // chdir() and fchdir() start a new generation, and `cwd_cached` holds
+    // the generation it was read in, or 0 while it is being written
+    std::atomic<uint64_t> cwd_generation{1};
+    std::atomic<uint64_t> cwd_cached{0};
+    std::atomic<dev_t> cwd_dev{0};
+    std::atomic<ino_t> cwd_ino{0};
+    std::mutex cwd_mutex;
+
+    // Absolute paths of the directories that relative paths were relative
+    // to, for filtering them. A directory that is renamed keeps its old path
+    ConcurrentMap<DirKey, std::string, DirKeyHash, std::equal_to<DirKey>> base_paths{epochs};
+
+    // Prebuilt index of read-only trees such as /opt/xwin, mapped from
+    // INSENSITIVE_INDEX. It answers all lookups under its roots
+    CasefoldIndex index;
+
+    // Positive resolutions of absolute paths shared with the other processes
+    // of the build session named by INSENSITIVE_SESSION, if any
+    SharedCache shared_cache;
+
+    // Call the real function first and only search for a case-insensitive
+    // match after it fails with ENOENT/ENOTDIR (INSENSITIVE_OPTIMISTIC)
+    bool optimistic;
+
+    // Counters written as a JSON report to the directory named by
+    // INSENSITIVE_STATS, at exit and on SIGUSR1
+    Stats stats;
+    // Slot of this process in the monitor of the build session, with
+    // INSENSITIVE_MONITOR set
+    Monitor monitor;
+    std::string stats_dir;
+    // Trace of the intercepted calls, with INSENSITIVE_RECORD set
+    int record_fd = -1;
+    char stats_report[PATH_MAX];
+    char stats_temporary[PATH_MAX + 4];
+
+    template<typename T>
+    T getFunctionPointer(const char* name) {
+        logger.debug("Getting function pointer for ", name);
+        T func = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+        if (!func) {
+            logger.error("Could not find original function ", name, ": ", dlerror());
+        }
+        return func;
+    }
+
+    // Parse a boolean environment variable, falling back to the given default
+    static bool env_flag(const char* name, bool default_value) {
+        const char* value = getenv(name);
+        if (!value || !*value) return default_value;
+        return strcmp(value, "0") != 0 &&
+               strcmp(value, "false") != 0 &&
+               strcmp(value, "no") != 0;
+    }
+
+    // Failure conventions of the intercepted functions
+    template<typename T>
+    static bool failed(T result) { return result == static_cast<T>(-1); }
+    static bool failed(DIR* result) { return result == nullptr; }
+
+    // Adjusted paths are returned in a per-thread buffer, so that lookups
+    // don't allocate. The result is valid until the next lookup of the thread
+    static const char* result(std::string_view path, const char* fallback) {
+        static thread_local char buffer[PATH_MAX];
+        if (path.size() >= sizeof(buffer)) return fallback;
+        memcpy(buffer, path.data(), path.size());
+        buffer[path.size()] = '\0';
+        return buffer;
+    }
+
+    // Find a path among the recent cache hits of the thread. The value is
+    // valid until the next lookup of the thread, like a result
+    const char* find_recent_hit(const PathKeyView& key, size_t hash, uint64_t generation) {
+        if (!recent_hits) return nullptr;
+        const RecentHits::Entry& entry = recent_hits->entries[hash % std::size(recent_hits->entries)];
+        if (entry.generation != generation || entry.hash != hash || !(entry.base == key.base) ||
+            std::string_view(entry.data, entry.path_length) != key.path) {
+            return nullptr;
+        }
+        return entry.data + entry.path_length;
+    }
+
+    void add_recent_hit(const PathKeyView& key, size_t hash, uint64_t generation, std::string_view value) {
+        if (key.path.size() + value.size() >= sizeof(RecentHits::Entry::data)) return;
+        if (!recent_hits) {
+            recent_hits = new RecentHits();
+            pthread_setspecific(recent_hits_key, recent_hits);
+        }
+        RecentHits::Entry& entry = recent_hits->entries[hash % std::size(recent_hits->entries)];
+        entry.generation = generation;
+        entry.hash = hash;
+        entry.base = key.base;
+        entry.path_length = key.path.size();
+        entry.value_length = value.size();
+        memcpy(entry.data, key.path.data(), key.path.size());
+        memcpy(entry.data + key.path.size(), value.data(), value.size());
+        entry.data[key.path.size() + value.size()] = '\0';
+    }
+
+    // Check if a path should be excluded from case-insensitive handling.
+    // Relative paths are checked by should_exclude_relative() once their
+    // base is known
+    bool should_exclude_path(const char* path) {
+        if (!path || path[0] != '/' || filter.handles("", path)) return false;
+        logger.trace("Path '", path, "' excluded from case-insensitive handling");
+        return true;
+    }
+
+    // Path of the directory that `dirfd` refers to, or of the current
+    // directory for AT_FDCWD, without a terminator
+    ssize_t directory_of(int dirfd, char* dir, size_t size) {
+        ssize_t length;
+        if (dirfd == AT_FDCWD) {
+            length = getcwd(dir, size) ? strlen(dir) : -1;
+        } else {
+            char fd_path[32];
+            snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", dirfd);
+            length = readlink_real(fd_path, dir, size - 1);
+        }
+        return length > 0 && dir[0] == '/' ? length : -1;
+    }
+
+    bool should_exclude_relative(int dirfd, const DirKey& base, const char* path) {
+        bool handled = true;
+        if (!base_paths.find(base, [&](const std::string& dir) { handled = filter.handles(dir, path); })) {
+            char dir[PATH_MAX];
+            ssize_t length = directory_of(dirfd, dir, sizeof(dir));
+            if (length <= 0) return false;
+
+            std::string_view dir_path(dir, length);
+            logger.debug("Relative paths from ", dirfd == AT_FDCWD ? "the current directory" : "a dirfd",
+                         " are relative to ", dir_path);
+            handled = filter.handles(dir_path, path);
+            base_paths.insert_or_assign(base, std::string(dir_path));
+        }
+        if (!handled) logger.trace("Path '", path, "' excluded from case-insensitive handling");
+        return !handled;
+    }
+
+    bool file_exists_real(int dirfd, const char* path) {
+        logger.trace("Checking if file exists: ", path);
+        struct stat st;
+        int result = fstatat_real(dirfd, path, &st, 0);
+        logger.trace("File ", path, " exists? ", result == 0 ? "yes" : "no");
+        return result == 0;
+    }
+
+    // Check for an absolute path without empty, "." or ".." components,
+    // which is the form of the paths in the prebuilt index
+    static bool is_normalized_absolute(const char* path) {
+        if (path[0] != '/') return false;
+        const char* component = path + 1;
+        for (const char* c = component; ; c++) {
+            if (*c != '/' && *c != '\0') continue;
+            size_t length = c - component;
+            if (length == 0 && *c == '/') return false;
+            if (length == 1 && component[0] == '.') return false;
+            if (length == 2 && component[0] == '.' && component[1] == '.') return false;
+            if (*c == '\0') return length != 0 || c == path + 1;
+            component = c + 1;
+        }
+    }
+
+    // Directories are passed to the real functions as "." when a relative
+    // path resolves to the current directory itself
+    static const char* dir_arg(const std::string& dir_path) {
+        return dir_path.empty() ? "." : dir_path.c_str();
+    }
+
+    static std::string join(const std::string& dir_path, std::string_view name) {
+        std::string joined = dir_path;
+        if (!joined.empty() && joined.back() != '/') joined += '/';
+        joined += name;
+        return joined;
+    }
+
+    // Identify the directory a path is relative to
+    bool base_of(int dirfd, const char* path, DirKey& base) {
+        if (path[0] == '/') {
+            base = DirKey{0, 0};
+            return true;
+        }
+
+        // The current directory is only stat'ed again after it changes
+        uint64_t generation = cwd_generation.load();
+        if (dirfd == AT_FDCWD && cwd_cached.load() == generation) {
+            base = DirKey{cwd_dev.load(), cwd_ino.load()};
+            if (cwd_cached.load() == generation && cwd_generation.load() == generation) return true;
+        }
+
+        struct stat st;
+        if (fstatat_real(dirfd, "", &st, AT_EMPTY_PATH) != 0) return false;
+        base = DirKey{st.st_dev, st.st_ino};
+        if (dirfd == AT_FDCWD) {
+            std::lock_guard<std::mutex> lock(cwd_mutex);
+            if (cwd_generation.load() == generation) {
+                cwd_cached.store(0);
+                cwd_dev.store(base.dev);
+                cwd_ino.store(base.ino);
+                cwd_cached.store(generation);
+            }
+        }
+        return true;
+    }
+
+    // Open a directory for scanning. We need to use the real functions to
+    // iterate through directories to avoid calling our intercepted ones
+    int open_directory(int dirfd, const std::string& dir_path) {
+        logger.debug("Opening directory: ", dir_arg(dir_path));
+        int fd = openat_real(dirfd, dir_arg(dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            logger.warning("Could not open directory: ", dir_arg(dir_path));
+        }
+        return fd;
+    }
+
+    // Read an open directory into a fresh index, straight from the kernel
+    // rather than through a DIR and its small buffer
+    bool scan_directory(int fd, const std::string& dir_path, DirIndex& index) {
+        if (!scan_buffer) {
+            scan_buffer = static_cast<char*>(malloc(scan_buffer_size));
+            if (!scan_buffer) return false;
+            pthread_setspecific(scan_buffer_key, scan_buffer);
+        }
+
+        stats.count(Stats::DIR_SCANS);
+        ssize_t length;
+        while ((length = getdents64(fd, scan_buffer, scan_buffer_size)) > 0) {
+            for (ssize_t offset = 0; offset < length; ) {
+                const struct dirent64* entry = reinterpret_cast<const struct dirent64*>(scan_buffer + offset);
+                offset += entry->d_reclen;
+                std::string_view direntry = entry->d_name;
+
+                // Keep . and .. apart, they are only listed
+                if (direntry == ".") {
+                    index.ino = entry->d_ino;
+                } else if (direntry == "..") {
+                    index.parent_ino = entry->d_ino;
+                } else {
+                    index.entries.push_back(DirIndex::Entry{std::string(direntry), entry->d_ino, entry->d_type});
+                }
+            }
+        }
+        if (length < 0) {
+            logger.warning("Could not read directory: ", dir_arg(dir_path));
+            return false;
+        }
+
+        // Keep the first entry if several differ only by case
+        for (const DirIndex::Entry& e : index.entries) index.names.insert(e.name);
+        stats.count(Stats::ENTRIES_SCANNED, index.entries.size());
+        INSENSITIVE_PROBE2(dir_scan, dir_path.c_str(), index.entries.size());
+
+        logger.debug("Indexed ", index.entries.size(), " entries of ", dir_arg(dir_path));
+        return true;
+    }
+
+    // Find the real name of an entry in a directory, given its name in any case.
+    // Matches found in the index are trusted as is, unless `fresh` is set,
+    // while a miss is only trusted after checking that the directory still
+    // has the mtime the index was built with. On a miss, `mtime` receives
+    // that mtime
+    bool find_in_directory(int dirfd, const std::string& dir_path, const DirKey& key,
+                           std::string_view name, std::string& real_name,
+                           struct timespec& mtime, bool fresh = false) {
+        bool indexed = false;
+        bool matched = false;
+        {
+            std::lock_guard<std::mutex> lock(dir_index_mutex);
+            auto it = dir_indexes.find(key);
+            if (it != dir_indexes.end()) {
+                logger.trace("Directory index hit for ", dir_arg(dir_path));
+                auto entry = it->second.names.find(name);
+                if (entry != it->second.names.end()) {
+                    real_name = *entry;
+                    if (!fresh) return true;
+                    matched = true;
+                }
+                mtime = it->second.mtime;
+                indexed = true;
+            }
+        }
+
+        auto gone = [&]() {
+            logger.debug("Directory has gone: ", dir_arg(dir_path));
+            mtime = timespec{-1, -1};
+            return false;
+        };
+
+        struct stat st;
+        if (indexed) {
+            if (fstatat_real(dirfd, dir_arg(dir_path), &st, 0) != 0 || st.st_dev != key.dev || st.st_ino != key.ino) {
+                return gone();
+            }
+            if (mtime.tv_sec == st.st_mtim.tv_sec && mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                return matched;
+            }
+        }
+
+        // The directory is identified through the fd it is scanned from, so
+        // that its path is only walked once
+        int fd = open_directory(dirfd, dir_path);
+        if (fd < 0) return gone();
+        if (fstatat_real(fd, "", &st, AT_EMPTY_PATH) != 0 || st.st_dev != key.dev || st.st_ino != key.ino) {
+            close(fd);
+            return gone();
+        }
+        mtime = st.st_mtim;
+
+        // Scan outside of the lock, so that other threads can keep using
+        // the indexes of other directories meanwhile
+        DirIndex index;
+        index.mtime = st.st_mtim;
+        bool scanned = scan_directory(fd, dir_path, index);
+        close(fd);
+        if (!scanned) return false;
+
+        bool found = false;
+        auto entry = index.names.find(name);
+        if (entry != index.names.end()) {
+            real_name = *entry;
+            found = true;
+        }
+
+        std::lock_guard<std::mutex> lock(dir_index_mutex);
+        dir_indexes[key] = std::move(index);
+        return found;
+    }
+
+    // Copy the index of a directory, scanning the directory first if it isn't
+    // indexed yet or has changed since. Fails with errno set like opendir()
+    bool list_directory(const char* dir_path, DirListing& listing) {
+        struct stat st;
+        if (stat_real(dir_path, &st) != 0) return false;
+        if (!S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            return false;
+        }
+        DirKey key{st.st_dev, st.st_ino};
+
+        auto copy = [&](const DirIndex& index) {
+            listing.ino = index.ino;
+            listing.parent_ino = index.parent_ino;
+            listing.entries = index.entries;
+        };
+        {
+            std::lock_guard<std::mutex> lock(dir_index_mutex);
+            auto it = dir_indexes.find(key);
+            if (it != dir_indexes.end() && it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+                it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                logger.trace("Listing ", dir_path, " from its index");
+                copy(it->second);
+                return true;
+            }
+        }
+
+        int fd = open_directory(AT_FDCWD, dir_path);
+        if (fd < 0) return false;
+        DirIndex index;
+        index.mtime = st.st_mtim;
+        bool scanned = scan_directory(fd, dir_path, index);
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        if (!scanned) return false;
+        copy(index);
+
+        std::lock_guard<std::mutex> lock(dir_index_mutex);
+        dir_indexes[key] = std::move(index);
+        return true;
+    }
+
+    // Directory functions of glob() for GLOB_ALTDIRFUNC, which serve the
+    // listings from the directory indexes
+    static void* glob_opendir(const char* dir_path) {
+        auto listing = std::make_unique<DirListing>();
+        if (!get().list_directory(*dir_path ? dir_path : ".", *listing)) return nullptr;
+        return listing.release();
+    }
+
+    static struct dirent64* glob_readdir(void* stream) {
+        DirListing& listing = *static_cast<DirListing*>(stream);
+        return listing.next < listing.entries.size() + 2 ? make_dirent(listing, listing.next++, listing.current) : nullptr;
+    }
+
+    static void glob_closedir(void* stream) {
+        delete static_cast<DirListing*>(stream);
+    }
+
+    // Fill the dirent of the i-th entry of a listing, counting "." and ".."
+    template<typename Dirent>
+    static Dirent* make_dirent(const DirListing& listing, size_t i, Dirent& dirent) {
+        std::string_view name = i == 0 ? std::string_view(".") : i == 1 ? std::string_view("..")
+                                                                        : std::string_view(listing.entries[i - 2].name);
+        dirent.d_ino = i == 0 ? listing.ino : i == 1 ? listing.parent_ino : listing.entries[i - 2].ino;
+        dirent.d_off = i + 1;
+        dirent.d_reclen = sizeof(Dirent);
+        dirent.d_type = i < 2 ? static_cast<unsigned char>(DT_DIR) : listing.entries[i - 2].type;
+        size_t length = std::min(name.size(), sizeof(dirent.d_name) - 1);
+        memcpy(dirent.d_name, name.data(), length);
+        dirent.d_name[length] = '\0';
+        return &dirent;
+    }
+
+    // Rewrite a glob pattern so that every letter matches in both cases,
+    // e.g. "Src/*.C" to "[sS][rR][cC]/*.[cC]". Bracket expressions get the
+    // other case of their letters and letter ranges added
+    static std::string fold_pattern(const char* pattern, int flags) {
+        bool escapes = !(flags & GLOB_NOESCAPE);
+        auto other_case = [](char c) {
+            return (c >= 'a' && c <= 'z') ? char(c - 'a' + 'A') : (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+        };
+        auto is_letter = [&](char c) { return other_case(c) != c; };
+
+        std::string folded;
+        const char* p = pattern;
+
+        // ~user is expanded before matching
+        if ((flags & GLOB_TILDE) && *p == '~') {
+            while (*p && *p != '/') folded += *p++;
+        }
+
+        while (*p) {
+            if (escapes && *p == '\\' && p[1]) {
+                if (is_letter(p[1])) {
+                    folded += {'[', p[1], other_case(p[1]), ']'};
+                } else {
+                    folded.append(p, 2);
+                }
+                p += 2;
+                continue;
+            }
+
+            if (*p == '[') {
+                // Find the end of the bracket expression; without one, '[' is literal
+                const char* end = p + 1;
+                if (*end == '!' || *end == '^') end++;
+                if (*end == ']') end++;
+                while (*end && *end != ']') {
+                    if (end[0] == '[' && end[1] == ':') {
+                        const char* close = strstr(end + 2, ":]");
+                        if (!close) break;
+                        end = close + 2;
+                    } else {
+                        end += (escapes && end[0] == '\\' && end[1]) ? 2 : 1;
+                    }
+                }
+                if (*end != ']') {
+                    folded += *p++;
+                    continue;
+                }
+
+                const char* q = p + 1;
+                folded += '[';
+                if (*q == '!' || *q == '^') folded += *q++;
+                if (*q == ']') folded += *q++;
+                while (q < end) {
+                    if (q[0] == '[' && q[1] == ':') {
+                        const char* close = strstr(q + 2, ":]") + 2;
+                        folded.append(q, close);
+                        q = close;
+                    } else if (escapes && q[0] == '\\' && q + 1 < end) {
+                        folded.append(q, 2);
+                        if (is_letter(q[1])) folded += other_case(q[1]);
+                        q += 2;
+                    } else if (q + 2 < end && q[1] == '-') {
+                        folded.append(q, 3);
+                        bool lower = q[0] >= 'a' && q[0] <= q[2] && q[2] <= 'z';
+                        bool upper = q[0] >= 'A' && q[0] <= q[2] && q[2] <= 'Z';
+                        if (lower || upper) folded += {other_case(q[0]), '-', other_case(q[2])};
+                        q += 3;
+                    } else {
+                        folded += *q;
+                        if (is_letter(*q)) folded += other_case(*q);
+                        q++;
+                    }
+                }
+                folded += ']';
+                p = end + 1;
+                continue;
+            }
+
+            if (is_letter(*p)) {
+                folded += {'[', *p, other_case(*p), ']'};
+            } else {
+                folded += *p;
+            }
+            p++;
+        }
+        return folded;
+    }
+
+    // Check whether the directory a negative entry depends on is unchanged
+    bool negative_entry_valid(int dirfd, const char* dir, const DirKey& key, const struct timespec& mtime,
+                              uint64_t creations_before) {
+        uint64_t latest = 0;
+        created_in.find(key, [&](uint64_t count) { latest = count; });
+        if (latest > creations_before) return false;
+
+        struct stat st;
+        if (fstatat_real(dirfd, dir, &st, 0) != 0) return false;
+        return st.st_dev == key.dev && st.st_ino == key.ino &&
+               st.st_mtim.tv_sec == mtime.tv_sec &&
+               st.st_mtim.tv_nsec == mtime.tv_nsec;
+    }
+
+    void add_negative_entry(const PathKey& key, const NegativeEntry& entry) {
+        logger.debug("Caching negative lookup: ", key.path, " (depends on ", dir_arg(entry.dir), ")");
+        negative_cache.insert_or_assign(key, entry);
+    }
+
+    // Options of a lookup
+    static constexpr unsigned CHECK_EXACT = 1; // check whether the path exists as is first
+    static constexpr unsigned FRESH = 2;       // trust neither memoized prefixes nor directory index matches
+    static constexpr unsigned CREATING = 4;    // the path is about to be created, so resolve its parent
+                                               // directory even if the path itself is missing in any case
+
+    // Walk the path one component at a time, matching each one against the
+    // index of the directory resolved so far. Every directory prefix is
+    // memoized, so that the walk of later paths starts from their longest
+    // known prefix. On a failed lookup, `miss` receives the directory the
+    // walk ended in, if any, and with CREATING, `resolved` receives the path
+    // with its parent resolved if only the last component is missing.
+    // Relative paths are walked from `dirfd`, whose identity is `base`
+    bool resolve_components(int dirfd, const DirKey& base, const char* path,
+                            std::string& resolved, NegativeEntry& miss, unsigned flags) {
+        bool fresh = flags & FRESH;
+        std::string_view input(path);
+        std::vector<std::string_view> components;
+        for (size_t begin = 0; begin < input.size(); ) {
+            size_t end = input.find('/', begin);
+            if (end == std::string_view::npos) end = input.size();
+            if (end > begin) components.push_back(input.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        if (components.empty()) return false;
+
+        auto prefix_of = [&](size_t count) {
+            const std::string_view& last = components[count - 1];
+            return PathKeyView{base, input.substr(0, last.data() + last.size() - input.data())};
+        };
+
+        // Find the longest memoized directory prefix
+        ResolvedDir dir;
+        size_t first = 0;
+        for (size_t count = components.size() - 1; count > 0 && !fresh; count--) {
+            if (prefixes.find(prefix_of(count), [&](const ResolvedDir& found) { dir = found; })) {
+                first = count;
+                break;
+            }
+        }
+
+        if (first == 0 && input[0] == '/') {
+            dir.path = "/";
+            struct stat st;
+            if (stat_real("/", &st) != 0) return false;
+            dir.key = DirKey{st.st_dev, st.st_ino};
+        } else if (first == 0) {
+            dir.path = "";
+            dir.key = base;
+        } else {
+            if (logger.isEnabledFor(DebugLogger::TRACE)) {
+                logger.trace("Prefix hit: ", prefix_of(first).path, " -> ", dir.path);
+            }
+        }
+
+        for (size_t i = first; i < components.size(); i++) {
+            std::string_view component = components[i];
+            bool last = i + 1 == components.size();
+            struct stat st;
+
+            // Directories are stat'ed anyway, so try their exact name first
+            // and only scan for the components that are missing. The caller
+            // has already found that the last component is missing
+            std::string next = join(dir.path, component);
+            bool exists = !last && fstatat_real(dirfd, next.c_str(), &st, 0) == 0;
+            if (!exists && component != "." && component != "..") {
+                std::string real_name;
+                struct timespec mtime;
+                if (!find_in_directory(dirfd, dir.path, dir.key, component, real_name, mtime, fresh)) {
+                    logger.trace("No match for '", component, "' in ", dir_arg(dir.path));
+                    if (mtime.tv_nsec >= 0) {
+                        miss = NegativeEntry{dir.path, dir.key, mtime};
+                    }
+                    if (last && (flags & CREATING)) {
+                        resolved = std::move(next);
+                        if (input.back() == '/') resolved += '/';
+                    }
+                    return false;
+                }
+                next = join(dir.path, real_name);
+                exists = !last && fstatat_real(dirfd, next.c_str(), &st, 0) == 0;
+            }
+
+            if (last) {
+                resolved = std::move(next);
+                if (input.back() == '/') resolved += '/';
+                return true;
+            }
+
+            if (!exists || !S_ISDIR(st.st_mode)) {
+                logger.trace("Not a directory: ", next);
+                return false;
+            }
+            dir.path = std::move(next);
+            dir.key = DirKey{st.st_dev, st.st_ino};
+
+            PathKeyView prefix = prefix_of(i + 1);
+            prefixes.insert_or_assign(PathKey{prefix.base, std::string(prefix.path)}, dir);
+        }
+        return false;
+    }
+
+    // Relative paths are resolved against `dirfd`, which may be AT_FDCWD.
+    // Returns either `path` itself or the adjusted path in the result buffer
+    const char* replace_filename_case_insensitive(int dirfd, const char* path, unsigned flags = CHECK_EXACT,
+                                                  bool* missing = nullptr) {
+        if (!path) return nullptr;
+        Stats::Timer timer(stats, Stats::RESOLVE_NS);
+        INSENSITIVE_PROBE2(lookup_entry, path, flags);
+        bool found_missing = false;
+        const char* adjusted_path = resolve_path(dirfd, path, flags, found_missing);
+        if (missing) *missing = found_missing;
+        INSENSITIVE_PROBE2(lookup_return, path, adjusted_path);
+        return adjusted_path;
+    }
+
+    // Sets `missing` if the lookup found that the path doesn't exist in any case
+    const char* resolve_path(int dirfd, const char* path, unsigned flags, bool& missing) {
+        logger.debug("Processing path: ", path);
+        
+        // Skip case-insensitive handling for excluded paths
+        if (should_exclude_path(path)) {
+            logger.debug("Path excluded, returning unchanged: ", path);
+            return path;
+        }
+        
+        // If path is empty or root directory, just return it
+        if (path[strspn(path, "/")] == '\0') {
+            logger.debug("Path is empty or root, returning unchanged: ", path);
+            return path;
+        }
+        
+        // Paths under the roots of the prebuilt index are resolved without
+        // syscalls, and those missing from it don't exist in any case
+        if (index.attached() && is_normalized_absolute(path) && index.covers(path)) {
+            std::string_view real_path;
+            if (index.lookup(path, real_path)) {
+                logger.debug("Index hit: ", path, " -> ", real_path);
+                stats.count(Stats::INDEX_HITS);
+                INSENSITIVE_PROBE1(index_hit, path);
+                if (real_path != path) monitor.count_miscased(path);
+                return result(real_path, path);
+            }
+            logger.debug("Index miss, path doesn't exist in any case: ", path);
+            stats.count(Stats::NEGATIVE_HITS);
+            INSENSITIVE_PROBE1(negative_hit, path);
+            missing = true;
+            return path;
+        }
+
+        // Relative paths are filtered before anything else is spent on them
+        PathKeyView key{DirKey{0, 0}, path};
+        if (!base_of(dirfd, path, key.base)) {
+            logger.debug("Could not identify the base directory, returning unchanged: ", path);
+            return path;
+        }
+        if (path[0] != '/' && should_exclude_relative(dirfd, key.base, path)) {
+            logger.debug("Path excluded, returning unchanged: ", path);
+            return path;
+        }
+
+        // If file exists with exact case, no need to search
+        if ((flags & CHECK_EXACT) && file_exists_real(dirfd, path)) {
+            logger.debug("File exists with exact case, returning unchanged: ", path);
+            stats.count(Stats::EXACT_HITS);
+            return path;
+        }
+
+        // Check cache first. Entries are keyed by the path as the caller passed it.
+        // The generation is read before the lookup, so that a hit copied by
+        // this thread is never newer than the generation it is recorded with
+        size_t hash = PathKeyHash()(key);
+        uint64_t generation = cache.generation();
+        if (const char* hit = find_recent_hit(key, hash, generation)) {
+            logger.debug("Recent cache hit: ", path, " -> ", hit);
+            stats.count(Stats::CACHE_HITS);
+            monitor.count_miscased(path);
+            INSENSITIVE_PROBE2(cache_hit, path, hit);
+            return hit;
+        }
+        const char* cached = nullptr;
+        cache.find(key, [&](const std::string& value) {
+            logger.debug("Cache hit: ", path, " -> ", value);
+            add_recent_hit(key, hash, generation, value);
+            cached = result(value, path);
+        });
+        if (cached) {
+            stats.count(Stats::CACHE_HITS);
+            monitor.count_miscased(path);
+            INSENSITIVE_PROBE2(cache_hit, path, cached);
+            return cached;
+        }
+        logger.trace("Cache miss for ", path);
+
+        // Another process of the build session may have resolved the path already
+        char shared_value[PATH_MAX];
+        size_t shared_length;
+        if (path[0] == '/' && (shared_length = shared_cache.lookup(path, shared_value, sizeof(shared_value)))) {
+            std::string_view value(shared_value, shared_length);
+            logger.debug("Shared cache hit: ", path, " -> ", value);
+            stats.count(Stats::CACHE_HITS);
+            monitor.count_miscased(path);
+            INSENSITIVE_PROBE2(cache_hit, path, shared_value);
+            cache.insert_or_assign(PathKey{key.base, path}, std::string(value));
+            return result(value, path);
+        }
+
+        // Then check whether the path is known not to exist in any case. Paths
+        // about to be created still need their parent resolved, which costs
+        // no more than checking the entry
+        char negative_dir[PATH_MAX];
+        DirKey negative_key;
+        struct timespec negative_mtime;
+        uint64_t negative_creations;
+        bool has_negative = false;
+        if (!(flags & CREATING)) negative_cache.find(key, [&](const NegativeEntry& entry) {
+            if (entry.dir.size() >= sizeof(negative_dir)) return;
+            strcpy(negative_dir, dir_arg(entry.dir));
+            negative_key = entry.key;
+            negative_mtime = entry.mtime;
+            negative_creations = entry.creations;
+            has_negative = true;
+        });
+        if (has_negative) {
+            if (negative_entry_valid(dirfd, negative_dir, negative_key, negative_mtime, negative_creations)) {
+                logger.debug("Negative cache hit: ", path);
+                stats.count(Stats::NEGATIVE_HITS);
+                INSENSITIVE_PROBE1(negative_hit, path);
+                missing = true;
+                return path;
+            }
+            logger.trace("Negative cache entry is stale: ", path);
+            negative_cache.erase(key);
+        }
+
+        std::string resolved;
+        NegativeEntry miss;
+        uint64_t creations_before = creations.load(std::memory_order_acquire);
+        if (!resolve_components(dirfd, key.base, path, resolved, miss, flags)) {
+            stats.count(Stats::UNRESOLVED);
+            missing = true;
+            if (miss.key.ino != 0) {
+                miss.creations = creations_before;
+                add_negative_entry(PathKey{key.base, path}, miss);
+            }
+            // Not cached, since the path doesn't exist yet
+            if (!resolved.empty() && resolved != path) {
+                logger.debug("No case-insensitive match found, creating in the resolved parent: ", resolved);
+                return result(resolved, path);
+            }
+            logger.debug("No case-insensitive match found, using original path: ", path);
+            return path;
+        }
+
+        logger.info("Found case-insensitive match: ", path, " -> ", resolved);
+        stats.count(Stats::RESOLVED);
+        monitor.count_miscased(path);
+        INSENSITIVE_PROBE2(match_found, path, resolved.c_str());
+
+        // Update cache
+        if (path[0] == '/') {
+            shared_cache.insert(path, resolved);
+        }
+        cache.insert_or_assign(PathKey{key.base, path}, resolved);
+        return result(resolved, path);
+    }
+
+    // Forget everything cached about a path whose adjusted form has turned
+    // out not to exist anymore, so that it is resolved again from scratch
+    void forget(int dirfd, const char* path) {
+        PathKeyView key{DirKey{0, 0}, path};
+        if (!base_of(dirfd, path, key.base)) return;
+        logger.debug("Forgetting stale resolution of ", path);
+
+        cache.erase(key);
+        if (path[0] == '/') shared_cache.erase(path);
+        std::string_view input(path);
+        for (size_t end = input.find('/', 1); end != std::string_view::npos; end = input.find('/', end + 1)) {
+            prefixes.erase(PathKeyView{key.base, input.substr(0, end)});
+        }
+        prefixes.erase(key);
+    }
+
+    // Drop the index of the directory that contains a path, if any, and
+    // return its key
+    bool drop_parent_index(int dirfd, const char* real_path, DirKey& key) {
+        std::string parent(real_path);
+        while (parent.size() > 1 && parent.back() == '/') parent.pop_back();
+        size_t slash = parent.rfind('/');
+        parent = slash == std::string::npos ? "." : slash == 0 ? "/" : parent.substr(0, slash);
+
+        struct stat st;
+        if (fstatat_real(dirfd, parent.c_str(), &st, 0) != 0) return false;
+        logger.debug("Dropping the index of ", parent, " after changing ", real_path);
+        key = DirKey{st.st_dev, st.st_ino};
+        std::lock_guard<std::mutex> lock(dir_index_mutex);
+        dir_indexes.erase(key);
+        return true;
+    }
+
+    // Drop what is cached about a path that this process has just removed or
+    // renamed away: its resolution, its memoized prefix if it was a directory,
+    // and the index of its parent directory, whose matches would otherwise be
+    // trusted. Resolutions of other paths to it are found stale on their next
+    // use
+    void removed(int dirfd, const char* path, const char* real_path) {
+        PathKeyView key{DirKey{0, 0}, path};
+        if (base_of(dirfd, path, key.base)) {
+            cache.erase(key);
+            prefixes.erase(key);
+        }
+        if (path[0] == '/') shared_cache.erase(path);
+
+        DirKey parent;
+        drop_parent_index(dirfd, real_path, parent);
+    }
+
+    // Map the resolution cache of the build session, creating it if this is
+    // the first process of the session
+    void attach_shared_cache(const char* session) {
+        if (strchr(session, '/')) {
+            logger.warning("Invalid INSENSITIVE_SESSION '", session, "', shared cache disabled");
+            return;
+        }
+
+        std::string shm_path = std::string("/dev/shm/insensitive-") + session;
+        int fd = open_real(shm_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            logger.warning("Could not open shared cache '", shm_path, "': ", strerror(errno));
+            return;
+        }
+        if (!shared_cache.attach(fd)) {
+            logger.warning("Could not map shared cache '", shm_path, "'");
+        } else {
+            logger.info("Attached shared cache: ", shm_path);
+        }
+        close(fd);
+    }
+
+    // Append to the trace, which the first process creates with its header
+    // under another name and links into place, so that no other process can
+    // append to it before the header is written
+    void open_trace(const char* path) {
+        record_fd = open_real(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (record_fd < 0 && errno == ENOENT) {
+            char temporary[PATH_MAX];
+            snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, getpid());
+            int fd = open_real(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                bool written = write(fd, TraceRecord::magic, sizeof(TraceRecord::magic)) == sizeof(TraceRecord::magic);
+                close(fd);
+                if (written) link_real(temporary, path);
+                unlink_real(temporary);
+            }
+            record_fd = open_real(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        }
+        if (record_fd < 0) {
+            logger.warning("Could not open trace '", path, "': ", strerror(errno));
+        } else {
+            logger.info("Recording calls to ", path);
+        }
+    }
+
+    void record_call(const char* func_name, int dirfd, const char* path, const char* adjusted_path, uint8_t flags) {
+        int saved_errno = errno;
+        char base[PATH_MAX];
+        ssize_t base_length = 0;
+        if (path[0] != '/') {
+            base_length = directory_of(dirfd, base, sizeof(base));
+            if (base_length < 0) base_length = 0;
+            if (dirfd != AT_FDCWD) flags |= TraceRecord::DIRFD;
+        }
+
+        TraceRecord record = {};
+        record.pid = getpid();
+        record.flags = flags;
+        record.function_length = std::min<size_t>(strlen(func_name), UINT8_MAX);
+        record.error = flags & TraceRecord::FAILED ? saved_errno : 0;
+        record.path_length = std::min<size_t>(strlen(path), UINT16_MAX);
+        record.adjusted_length = adjusted_path != path ? std::min<size_t>(strlen(adjusted_path), UINT16_MAX) : 0;
+        record.base_length = base_length;
+        record.size = sizeof(record) + record.function_length + record.path_length + record.adjusted_length +
+                      record.base_length;
+
+        struct iovec parts[] = {
+            {&record, sizeof(record)},
+            {const_cast<char*>(func_name), record.function_length},
+            {const_cast<char*>(path), record.path_length},
+            {const_cast<char*>(adjusted_path), record.adjusted_length},
+            {base, record.base_length},
+        };
+        if (writev(record_fd, parts, 5) < 0) logger.warning("Could not record a call: ", strerror(errno));
+        errno = saved_errno;
+    }
+
+    // Publish the counters of this process to insensitive-top
+    void attach_monitor(const char* session) {
+        if (strchr(session, '/')) return;
+
+        std::string shm_path = std::string("/dev/shm/insensitive-") + session + ".top";
+        int fd = open_real(shm_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            logger.warning("Could not open monitor '", shm_path, "': ", strerror(errno));
+            return;
+        }
+        if (!monitor.attach(fd, true) || !monitor.join(program_invocation_short_name)) {
+            logger.warning("Could not join monitor '", shm_path, "'");
+        } else {
+            logger.info("Joined monitor: ", shm_path);
+            start_counting();
+            stats.publish(monitor.counters());
+        }
+        close(fd);
+    }
+
+    // Map the prebuilt index read-only; a missing index is not an error
+    void load_index(const char* index_path) {
+        int fd = open_real(index_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            logger.debug("No prebuilt index at ", index_path);
+            return;
+        }
+
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+
+        if (data == MAP_FAILED || !index.attach(data, st.st_size)) {
+            logger.warning("Could not load prebuilt index ", index_path);
+            if (data != MAP_FAILED) munmap(data, st.st_size);
+            return;
+        }
+        logger.info("Loaded prebuilt index ", index_path, " with ", index.entry_count(), " paths");
+    }
+
+    // Name the report after the pid and the time the counting started, since
+    // a process keeps its pid across exec() and in a child after fork()
+    void name_stats_report() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(stats_report, sizeof(stats_report), "%s/insensitive-%d-%lld%09ld.json", stats_dir.c_str(),
+                 getpid(), static_cast<long long>(now.tv_sec), now.tv_nsec);
+        snprintf(stats_temporary, sizeof(stats_temporary), "%s.tmp", stats_report);
+    }
+
+    // Replace the report with the current counts. Only calls functions that
+    // are safe in a signal handler, and the real ones rather than ours
+    void write_stats_report() {
+        int fd = open_real(stats_temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return;
+        stats.write_report(fd, program_invocation_short_name, getpid());
+        close(fd);
+        rename_real(stats_temporary, stats_report);
+    }
+
+    static void finish_counting_at_exit() {
+        int saved_errno = errno;
+        Wrapper& wrapper = get();
+        if (!wrapper.stats_dir.empty()) wrapper.write_stats_report();
+        wrapper.stats.publish(nullptr);
+        wrapper.monitor.leave();
+        errno = saved_errno;
+    }
+
+    static void write_stats_on_signal(int) {
+        int saved_errno = errno;
+        get().write_stats_report();
+        errno = saved_errno;
+    }
+
+    // The child counts on its own, in a report and a monitor slot of its own
+    static void restart_counting_after_fork() {
+        Wrapper& wrapper = get();
+        wrapper.stats.reset_after_fork();
+        if (!wrapper.stats_dir.empty()) wrapper.name_stats_report();
+        if (wrapper.monitor.attached()) {
+            wrapper.monitor.join(program_invocation_short_name);
+            wrapper.stats.publish(wrapper.monitor.counters());
+        }
+    }
+
+    void start_counting() {
+        if (stats.enabled) return;
+        stats.enable();
+        atexit(finish_counting_at_exit);
+        pthread_atfork(nullptr, nullptr, restart_counting_after_fork);
+    }
+
+    void enable_stats(const char* dir) {
+        stats_dir = dir;
+        while (stats_dir.size() > 1 && stats_dir.back() == '/') stats_dir.pop_back();
+        name_stats_report();
+        start_counting();
+
+        // SIGUSR1 would end the process otherwise, so it is only taken over
+        // if nothing else handles it
+        struct sigaction current;
+        if (sigaction(SIGUSR1, nullptr, &current) == 0 && current.sa_handler == SIG_DFL) {
+            struct sigaction action = {};
+            action.sa_handler = write_stats_on_signal;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGUSR1, &action, nullptr);
+        }
+        logger.info("Writing stats to ", stats_report);
+    }
+
+    Wrapper() : optimistic(env_flag("INSENSITIVE_OPTIMISTIC", true)) {
+        // Bind all function pointers to the original functions
+        BIND(open);
+        BIND(open64);
+        BIND(openat);
+        BIND(stat);
+        BIND(lstat);
+        BIND(fstatat);
+        BIND(stat64);
+        BIND(lstat64);
+        BIND(fstatat64);
+        BIND(statx);
+        BIND(__xstat);
+        BIND(__lxstat);
+        BIND(__fxstatat);
+        BIND(__xstat64);
+        BIND(__lxstat64);
+        BIND(__fxstatat64);
+        BIND(creat);
+        BIND(creat64);
+        BIND(mkdir);
+        BIND(mkdirat);
+        BIND(rmdir);
+        BIND(unlink);
+        BIND(unlinkat);
+        BIND(rename);
+        BIND(renameat);
+        BIND(renameat2);
+        BIND(link);
+        BIND(linkat);
+        BIND(symlink);
+        BIND(symlinkat);
+        BIND(utimensat);
+        BIND(glob);
+        BIND(glob64);
+        BIND(fnmatch);
+        BIND(scandir);
+        BIND(scandir64);
+        BIND(access);
+        BIND(faccessat);
+        BIND(opendir);
+        BIND(readlink);
+        BIND(readdir);
+        BIND(closedir);
+        BIND(chdir);
+        BIND(fchdir);
+
+        // Children still preload the library and decide for themselves
+        if (const char* processes = getenv("INSENSITIVE_PROCESSES"); processes && *processes) {
+            char exe[PATH_MAX];
+            ssize_t length = readlink_real("/proc/self/exe", exe, sizeof(exe));
+            bypassed = !handles_program(processes, std::string_view(exe, length > 0 ? length : 0),
+                                        program_invocation_name);
+            if (bypassed) {
+                logger.info("Not handling ", program_invocation_name, ", which INSENSITIVE_PROCESSES leaves out");
+                return;
+            }
+        }
+
+        pthread_key_create(&recent_hits_key, [](void* hits) { delete static_cast<RecentHits*>(hits); });
+        pthread_key_create(&scan_buffer_key, free);
+
+        // Pseudo-filesystems are never handled
+        filter.add_list("/dev:/proc:/sys", false);
+        if (const char* roots = getenv("INSENSITIVE_ROOTS")) filter.add_list(roots, true);
+        if (const char* exclude = getenv("INSENSITIVE_EXCLUDE")) filter.add_list(exclude, false);
+
+        const char* index_path = getenv("INSENSITIVE_INDEX");
+        if (!index_path) index_path = "/opt/xwin/lib/libinsensitive.idx";
+        if (*index_path) {
+            load_index(index_path);
+        }
+
+        const char* session = getenv("INSENSITIVE_SESSION");
+        if (session && *session && env_flag("INSENSITIVE_SHARED_CACHE", false)) {
+            attach_shared_cache(session);
+        }
+        if (session && *session && env_flag("INSENSITIVE_MONITOR", false)) {
+            attach_monitor(session);
+        }
+
+        const char* record_path = getenv("INSENSITIVE_RECORD");
+        if (record_path && *record_path) {
+            open_trace(record_path);
+        }
+
+        const char* stats_path = getenv("INSENSITIVE_STATS");
+        if (stats_path && *stats_path) {
+            enable_stats(stats_path);
+        }
+        
+        logger.info("Initialization complete, debug level: ", logger.getLevel(),
+                    ", optimistic: ", optimistic ? "yes" : "no");
+    }
+
+public:
+
+    // What an intercepted call does to the path it is given
+    enum Effect {
+        READS,
+        CREATES, // may create it, so an existing file in another case is looked up first
+        REMOVES  // removes or renames it, so what is cached about it is dropped
+    };
+
+    // Log the result of an intercepted call without clobbering its errno
+    template<typename T>
+    T log_exit(const char* func_name, T result) {
+        if (logger.isEnabledFor(DebugLogger::DEBUG)) {
+            int saved_errno = errno;
+            logger.debug("EXIT: ", func_name, "() -> ", result);
+            errno = saved_errno;
+        }
+        return result;
+    }
+
+    // Implementation of wrap_func to call the real function with the path
+    // adjusted for case, either before the call or only after it fails
+    template<typename Call>
+    auto wrap_func(const char* func_name, int dirfd, const char* path, Effect effect, Call call) -> decltype(call(path)) {
+        Stats::Scope scope(stats, func_name);
+        INSENSITIVE_PROBE2(call_entry, func_name, path);
+        const char* adjusted_path = path;
+        decltype(call(path)) result;
+        uint8_t looked_up = 0;
+        bool missing = false;
+
+        // Creating calls must reuse an existing differently-cased file rather
+        // than create a new one, so they always look it up first
+        if (!optimistic || effect == CREATES || !path) {
+            adjusted_path = case_adjusted_path(func_name, dirfd, path, effect == CREATES, &missing);
+            looked_up = TraceRecord::LOOKED_UP;
+            result = call(adjusted_path);
+        } else {
+            logger.debug("ENTER: ", func_name, "(", path, ")");
+
+            result = call(path);
+            if (!failed(result)) {
+                stats.count(Stats::EXACT_HITS);
+            } else if (errno == ENOENT || errno == ENOTDIR) {
+                // The exact path is known to be missing, so skip checking it again
+                int saved_errno = errno;
+                adjusted_path = replace_filename_case_insensitive(dirfd, path, 0);
+                looked_up = TraceRecord::LOOKED_UP | TraceRecord::KNOWN_MISSING;
+                if (adjusted_path != path && strcmp(path, adjusted_path) != 0) {
+                    logger.debug("ADJUST: ", func_name, " path ", path, " -> ", adjusted_path);
+                    result = call(adjusted_path);
+                } else {
+                    adjusted_path = path;
+                    errno = saved_errno;
+                }
+            }
+        }
+
+        // The adjusted path may have been removed or renamed, by this or by
+        // another process, since it was cached
+        if (adjusted_path != path && failed(result) && (errno == ENOENT || errno == ENOTDIR)) {
+            int saved_errno = errno;
+            forget(dirfd, path);
+            adjusted_path = replace_filename_case_insensitive(dirfd, path, FRESH | (effect == CREATES ? CREATING : 0),
+                                                              &missing);
+            if (adjusted_path != path && strcmp(path, adjusted_path) != 0) {
+                logger.debug("ADJUST: ", func_name, " path ", path, " -> ", adjusted_path, " (resolved again)");
+                result = call(adjusted_path);
+            } else {
+                adjusted_path = path;
+                errno = saved_errno;
+            }
+        }
+
+        if (effect == REMOVES && !failed(result)) {
+            removed(dirfd, path, adjusted_path);
+        } else if (effect == CREATES && missing && !failed(result)) {
+            created(dirfd, path, adjusted_path);
+        }
+        INSENSITIVE_PROBE4(call_return, func_name, adjusted_path, failed(result), failed(result) ? errno : 0);
+        if (record_fd >= 0 && path) {
+            record_call(func_name, dirfd, path, adjusted_path, looked_up |
+                        (effect == CREATES ? TraceRecord::CREATES : 0) | (effect == REMOVES ? TraceRecord::REMOVES : 0) |
+                        (failed(result) ? TraceRecord::FAILED : 0));
+        }
+        return log_exit(func_name, result);
+    }
+
+    static void free_glob(glob_t* pglob) { globfree(pglob); }
+    static void free_glob(glob64_t* pglob) { globfree64(pglob); }
+
+    // Match a glob pattern case-insensitively, reading the directories from
+    // their indexes unless the caller brings its own directory functions,
+    // like GNU make does. A pattern without wildcards is only a check that
+    // the path exists, so it is matched as given first, which needs no
+    // directory to be readable, and folded only if that finds nothing. Glob
+    // is glob_t or glob64_t, which have the same layout on 64-bit targets
+    template<typename Glob, typename Stat>
+    int match_glob(const char* pattern, int flags, int (*errfunc)(const char*, int), Glob* pglob,
+             int (*real)(const char*, int, int (*)(const char*, int), Glob*),
+             int (*lstat_func)(const char*, Stat*), int (*stat_func)(const char*, Stat*)) {
+        Stats::Scope scope(stats, "glob");
+        logger.debug("ENTER: glob(", pattern, ")");
+
+        DirKey base;
+        if (should_exclude_path(pattern) ||
+            (pattern[0] != '/' && (!base_of(AT_FDCWD, pattern, base) || should_exclude_relative(AT_FDCWD, base, pattern)))) {
+            return log_exit("glob", real(pattern, flags, errfunc, pglob));
+        }
+
+        // A failed attempt leaves the array of GLOB_DOOFFS allocated, which
+        // the next one would replace unless it appends
+        auto retry = [&](const char* attempt, int attempt_flags) {
+            if (!(flags & GLOB_APPEND)) free_glob(pglob);
+            return real(attempt, attempt_flags, errfunc, pglob);
+        };
+
+        bool magic = strpbrk(pattern, "*?[") != nullptr;
+        if (!magic) {
+            int result = real(pattern, flags & ~GLOB_NOCHECK, errfunc, pglob);
+            if (result != GLOB_NOMATCH) return log_exit("glob", result);
+        }
+
+        std::string folded = fold_pattern(pattern, flags);
+        logger.debug("Matching glob pattern ", pattern, " as ", folded);
+        int folded_flags = flags & ~GLOB_NOCHECK;
+        if (!(flags & GLOB_ALTDIRFUNC)) {
+            folded_flags |= GLOB_ALTDIRFUNC;
+            pglob->gl_opendir = glob_opendir;
+            pglob->gl_readdir = reinterpret_cast<decltype(pglob->gl_readdir)>(glob_readdir);
+            pglob->gl_closedir = glob_closedir;
+            pglob->gl_lstat = lstat_func;
+            pglob->gl_stat = stat_func;
+        }
+
+        int result = magic ? real(folded.c_str(), folded_flags, errfunc, pglob) : retry(folded.c_str(), folded_flags);
+        if (result == 0 && !magic) {
+            pglob->gl_flags &= ~GLOB_MAGCHAR;
+        }
+
+        // Without a match, GLOB_NOCHECK returns the pattern as the caller gave it
+        if (result == GLOB_NOMATCH && (flags & GLOB_NOCHECK)) {
+            result = retry(pattern, flags);
+        }
+        return log_exit("glob", result);
+    }
+
+    // List a directory from its index for scandir(), which callers free
+    // entry by entry. Falls back to the real function if it can't be indexed
+    template<typename Dirent, typename Real>
+    int list_for_scandir(const char* path, Dirent*** namelist, int (*filter)(const Dirent*),
+                         int (*compar)(const Dirent**, const Dirent**), Real real) {
+        Stats::Scope scope(stats, "scandir");
+        DirListing listing;
+        if (!list_directory(path, listing)) {
+            if (errno == ENOENT || errno == ENOTDIR) return -1;
+            return real(path, namelist, filter, compar);
+        }
+
+        std::vector<Dirent*> selected;
+        bool out_of_memory = false;
+        for (size_t i = 0; i < listing.entries.size() + 2 && !out_of_memory; i++) {
+            Dirent* dirent = static_cast<Dirent*>(malloc(sizeof(Dirent)));
+            out_of_memory = !dirent;
+            if (!dirent) break;
+            make_dirent(listing, i, *dirent);
+            if (filter && !filter(dirent)) {
+                free(dirent);
+                continue;
+            }
+            selected.push_back(dirent);
+        }
+
+        Dirent** list = static_cast<Dirent**>(malloc(std::max<size_t>(1, selected.size()) * sizeof(Dirent*)));
+        if (!list || out_of_memory) {
+            for (Dirent* dirent : selected) free(dirent);
+            free(list);
+            errno = ENOMEM;
+            return -1;
+        }
+        std::copy(selected.begin(), selected.end(), list);
+        if (compar) {
+            qsort(list, selected.size(), sizeof(Dirent*), reinterpret_cast<int (*)(const void*, const void*)>(compar));
+        }
+        *namelist = list;
+        return selected.size();
+    }
+
+    // Drop what is cached about a path that this process has just created,
+    // or renamed or linked into place: what it resolved to or that it was
+    // missing, and the index of its parent directory, whose mtime may not
+    // have changed if timestamps are coarse. Misses of other paths in that
+    // directory are found stale through its creation count. The index is
+    // dropped first, so that a lookup that sees the new count rescans it.
+    // Calls that only rewrite an existing file, such as an O_CREAT open of
+    // an object file, change no names, so the lookup before them must have
+    // found the path missing
+    void created(int dirfd, const char* path, const char* real_path) {
+        PathKeyView key{DirKey{0, 0}, path};
+        if (base_of(dirfd, path, key.base)) {
+            cache.erase(key);
+            negative_cache.erase(key);
+        }
+        if (path[0] == '/') shared_cache.erase(path);
+
+        DirKey parent;
+        if (drop_parent_index(dirfd, real_path, parent)) {
+            created_in.insert_or_assign(parent, creations.fetch_add(1, std::memory_order_acq_rel) + 1);
+        }
+    }
+
+    // Stop trusting the cached identity of the current directory
+    void changed_directory() {
+        std::lock_guard<std::mutex> lock(cwd_mutex);
+        cwd_generation++;
+    }
+
+    // Look up the path that a call with two paths, such as rename(), creates,
+    // and copy it out of the result buffer so that the other path can be
+    // looked up too. `missing` tells whether the path doesn't exist yet
+    const char* created_path(const char* func_name, int dirfd, const char* path, char (&copy)[PATH_MAX],
+                             bool& missing) {
+        const char* adjusted_path = case_adjusted_path(func_name, dirfd, path, true, &missing);
+        if (adjusted_path == path) return path;
+        strcpy(copy, adjusted_path);
+        return copy;
+    }
+
+    // Resolve a path the way intercepted calls do, for tools linked with or
+    // preloading the library
+    const char* resolve(int dirfd, const char* path, bool known_missing, bool creating) {
+        return replace_filename_case_insensitive(dirfd, path, (known_missing ? 0 : CHECK_EXACT) | (creating ? CREATING : 0));
+    }
+
+    // Implementation of case_adjusted_path to handle path adjustment with logging
+    const char* case_adjusted_path(const char* func_name, int dirfd, const char* path, bool creating = false,
+                                   bool* missing = nullptr) {
+        logger.debug("ENTER: ", func_name, "(", path ? path : "(null)", ")");
+        
+        const char* adjusted_path = replace_filename_case_insensitive(dirfd, path, CHECK_EXACT | (creating ? CREATING : 0),
+                                                                      missing);
+        
+        if (adjusted_path != path) {
+            logger.debug("ADJUST: ", func_name, " path ", path, " -> ", adjusted_path);
+        }
+        
+        return adjusted_path;
+    }
+
+    // Define all function pointers for the functions we'll intercept
+    DEF(open);
+    DEF(open64);
+    DEF(openat);
+    DEF(stat);
+    DEF(lstat);
+    DEF(fstatat);
+    DEF(stat64);
+    DEF(lstat64);
+    DEF(fstatat64);
+    DEF(statx);
+    DEF(__xstat);
+    DEF(__lxstat);
+    DEF(__fxstatat);
+    DEF(__xstat64);
+    DEF(__lxstat64);
+    DEF(__fxstatat64);
+    DEF(creat);
+    DEF(creat64);
+    DEF(mkdir);
+    DEF(mkdirat);
+    DEF(rmdir);
+    DEF(unlink);
+    DEF(unlinkat);
+    DEF(rename);
+    DEF(renameat);
+    DEF(renameat2);
+    DEF(link);
+    DEF(linkat);
+    DEF(symlink);
+    DEF(symlinkat);
+    DEF(utimensat);
+    DEF(glob);
+    DEF(glob64);
+    DEF(fnmatch);
+    DEF(scandir);
+    DEF(scandir64);
+    DEF(access);
+    DEF(faccessat);
+    DEF(opendir);
+    DEF(readlink);
+    DEF(readdir);
+    DEF(closedir);
+    DEF(chdir);
+    DEF(fchdir);
+
+    // The process doesn't match INSENSITIVE_PROCESSES, so every intercepted
+    // call goes straight to the real function
+    bool bypassed = false;
+
+    // Match the file name patterns of fnmatch() in any case (INSENSITIVE_FNMATCH)
+    bool fold_fnmatch = env_flag("INSENSITIVE_FNMATCH", false);
+
+    DebugLogger logger;
+
+    static Wrapper& get()
+    {
+        // Do not destroy, since the order of destruction is undetermined.
+        static Wrapper* wrapper = nullptr;
+        if (!wrapper) wrapper = new Wrapper();
+        return *wrapper;
+    }
+};
+
+// Call the real function right away in a process left out by
+// INSENSITIVE_PROCESSES, which compiles to a jump
+#define BYPASS(func, ...) \
+    if (Wrapper::get().bypassed) return Wrapper::get().func##_real(__VA_ARGS__)
+
+// Helper macro to make function calls cleaner: the arguments are passed
+// to the real function with `path`, relative to `dirfd`, replaced by the
+// case-adjusted path
+#define WRAP(func, dirfd, creates, path, ...) \
+    (Wrapper::get().bypassed ? Wrapper::get().func##_real(__VA_ARGS__) : \
+     Wrapper::get().wrap_func(#func, dirfd, path, (creates) ? Wrapper::CREATES : Wrapper::READS, \
+         [&](const char* path) { return Wrapper::get().func##_real(__VA_ARGS__); }))
+
+// Same for the functions that remove `path` or rename it away
+#define WRAP_REMOVE(func, dirfd, path, ...) \
+    (Wrapper::get().bypassed ? Wrapper::get().func##_real(__VA_ARGS__) : \
+     Wrapper::get().wrap_func(#func, dirfd, path, Wrapper::REMOVES, \
+         [&](const char* path) { return Wrapper::get().func##_real(__VA_ARGS__); }))
+
+// The library is built with hidden visibility, so that only the functions
+// below are exported: insensitive_resolve() and the libc functions it
+// interposes
+#pragma GCC visibility push(default)
+
+// Return the real path of `path`, relative to `dirfd`, or `path` itself if it
+// exists as is or doesn't exist in any case. An adjusted path is valid until
+// the next call from the same thread. Flags:
+//   1  the exact path is known to be missing, so it isn't checked
+//   2  the path is about to be created, so its parent directory is resolved
+//      even if the path itself is missing in any case
+// A process left out by INSENSITIVE_PROCESSES gets `path` back
+extern "C" const char* insensitive_resolve(int dirfd, const char* path, int flags) {
+    Wrapper& wrapper = Wrapper::get();
+    if (wrapper.bypassed) return path;
+    return wrapper.resolve(dirfd, path, flags & 1, flags & 2);
+}
+
+int open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    
+    return WRAP(open, AT_FDCWD, flags & O_CREAT, path, path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    
+    return WRAP(open64, AT_FDCWD, flags & O_CREAT, path, path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    
+    return WRAP(openat, dirfd, flags & O_CREAT, path, dirfd, path, flags, mode);
+}
+
+int stat(const char *path, struct stat *buf) {
+    return WRAP(stat, AT_FDCWD, false, path, path, buf);
+}
+
+int lstat(const char *path, struct stat *buf) {
+    return WRAP(lstat, AT_FDCWD, false, path, path, buf);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *buf, int flags) {
+    return WRAP(fstatat, dirfd, false, path, dirfd, path, buf, flags);
+}
+
+int stat64(const char *path, struct stat64 *buf) {
+    return WRAP(stat64, AT_FDCWD, false, path, path, buf);
+}
+
+int lstat64(const char *path, struct stat64 *buf) {
+    return WRAP(lstat64, AT_FDCWD, false, path, path, buf);
+}
+
+int fstatat64(int dirfd, const char *path, struct stat64 *buf, int flags) {
+    return WRAP(fstatat64, dirfd, false, path, dirfd, path, buf, flags);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf) {
+    return WRAP(statx, dirfd, false, path, dirfd, path, flags, mask, buf);
+}
+
+int __xstat(int ver, const char *path, struct stat *buf) {
+    return WRAP(__xstat, AT_FDCWD, false, path, ver, path, buf);
+}
+
+int __lxstat(int ver, const char *path, struct stat *buf) {
+    return WRAP(__lxstat, AT_FDCWD, false, path, ver, path, buf);
+}
+
+int __fxstatat(int ver, int dirfd, const char *path, struct stat *buf, int flags) {
+    return WRAP(__fxstatat, dirfd, false, path, ver, dirfd, path, buf, flags);
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *buf) {
+    return WRAP(__xstat64, AT_FDCWD, false, path, ver, path, buf);
+}
+
+int __lxstat64(int ver, const char *path, struct stat64 *buf) {
+    return WRAP(__lxstat64, AT_FDCWD, false, path, ver, path, buf);
+}
+
+int __fxstatat64(int ver, int dirfd, const char *path, struct stat64 *buf, int flags) {
+    return WRAP(__fxstatat64, dirfd, false, path, ver, dirfd, path, buf, flags);
+}
+
+int creat(const char *path, mode_t mode) {
+    return WRAP(creat, AT_FDCWD, true, path, path, mode);
+}
+
+int creat64(const char *path, mode_t mode) {
+    return WRAP(creat64, AT_FDCWD, true, path, path, mode);
+}
+
+int mkdir(const char *path, mode_t mode) {
+    return WRAP(mkdir, AT_FDCWD, true, path, path, mode);
+}
+
+int mkdirat(int dirfd, const char *path, mode_t mode) {
+    return WRAP(mkdirat, dirfd, true, path, dirfd, path, mode);
+}
+
+int rmdir(const char *path) {
+    return WRAP_REMOVE(rmdir, AT_FDCWD, path, path);
+}
+
+int unlink(const char *path) {
+    return WRAP_REMOVE(unlink, AT_FDCWD, path, path);
+}
+
+int unlinkat(int dirfd, const char *path, int flags) {
+    return WRAP_REMOVE(unlinkat, dirfd, path, dirfd, path, flags);
+}
+
+// The new path replaces an existing file in any case, like on Windows
+int rename(const char *path, const char *newpath) {
+    BYPASS(rename, path, newpath);
+    char new_path[PATH_MAX];
+    bool missing;
+    const char* adjusted_newpath = Wrapper::get().created_path("rename", AT_FDCWD, newpath, new_path, missing);
+    int result = WRAP_REMOVE(rename, AT_FDCWD, path, path, adjusted_newpath);
+    if (result == 0 && missing) Wrapper::get().created(AT_FDCWD, newpath, adjusted_newpath);
+    return result;
+}
+
+int renameat(int dirfd, const char *path, int newdirfd, const char *newpath) {
+    BYPASS(renameat, dirfd, path, newdirfd, newpath);
+    char new_path[PATH_MAX];
+    bool missing;
+    const char* adjusted_newpath = Wrapper::get().created_path("renameat", newdirfd, newpath, new_path, missing);
+    int result = WRAP_REMOVE(renameat, dirfd, path, dirfd, path, newdirfd, adjusted_newpath);
+    if (result == 0 && missing) Wrapper::get().created(newdirfd, newpath, adjusted_newpath);
+    return result;
+}
+
+int renameat2(int dirfd, const char *path, int newdirfd, const char *newpath, unsigned int flags) {
+    BYPASS(renameat2, dirfd, path, newdirfd, newpath, flags);
+    char new_path[PATH_MAX];
+    bool missing;
+    const char* adjusted_newpath = Wrapper::get().created_path("renameat2", newdirfd, newpath, new_path, missing);
+    int result = WRAP_REMOVE(renameat2, dirfd, path, dirfd, path, newdirfd, adjusted_newpath, flags);
+    if (result == 0 && missing) Wrapper::get().created(newdirfd, newpath, adjusted_newpath);
+    return result;
+}
+
+int link(const char *path, const char *newpath) {
+    BYPASS(link, path, newpath);
+    char new_path[PATH_MAX];
+    bool missing;
+    const char* adjusted_newpath = Wrapper::get().created_path("link", AT_FDCWD, newpath, new_path, missing);
+    int result = WRAP(link, AT_FDCWD, false, path, path, adjusted_newpath);
+    if (result == 0 && missing) Wrapper::get().created(AT_FDCWD, newpath, adjusted_newpath);
+    return result;
+}
+
+int linkat(int dirfd, const char *path, int newdirfd, const char *newpath, int flags) {
+    BYPASS(linkat, dirfd, path, newdirfd, newpath, flags);
+    char new_path[PATH_MAX];
+    bool missing;
+    const char* adjusted_newpath = Wrapper::get().created_path("linkat", newdirfd, newpath, new_path, missing);
+    int result = WRAP(linkat, dirfd, false, path, dirfd, path, newdirfd, adjusted_newpath, flags);
+    if (result == 0 && missing) Wrapper::get().created(newdirfd, newpath, adjusted_newpath);
+    return result;
+}
+
+// The target of a symbolic link is kept as given, only the link is looked up
+int symlink(const char *target, const char *path) {
+    return WRAP(symlink, AT_FDCWD, true, path, target, path);
+}
+
+int symlinkat(const char *target, int dirfd, const char *path) {
+    return WRAP(symlinkat, dirfd, true, path, target, dirfd, path);
+}
+
+int utimensat(int dirfd, const char *path, const struct timespec times[2], int flags) {
+    return WRAP(utimensat, dirfd, false, path, dirfd, path, times, flags);
+}
+
+int glob(const char *pattern, int flags, int (*errfunc)(const char *, int), glob_t *pglob) {
+    BYPASS(glob, pattern, flags, errfunc, pglob);
+    Wrapper& wrapper = Wrapper::get();
+    return wrapper.match_glob(pattern, flags, errfunc, pglob, wrapper.glob_real, wrapper.lstat_real, wrapper.stat_real);
+}
+
+int glob64(const char *pattern, int flags, int (*errfunc)(const char *, int), glob64_t *pglob) {
+    BYPASS(glob64, pattern, flags, errfunc, pglob);
+    Wrapper& wrapper = Wrapper::get();
+    return wrapper.match_glob(pattern, flags, errfunc, pglob, wrapper.glob64_real, wrapper.lstat64_real, wrapper.stat64_real);
+}
+
+// With INSENSITIVE_FNMATCH=1, patterns passed with flags that make sense for
+// file names match in any case. Programs such as make or a shell pass these
+// flags to match other strings too, such as targets or arguments, so this is
+// off by default: glob() and scandir() match in any case without it
+int fnmatch(const char *pattern, const char *string, int flags) {
+    BYPASS(fnmatch, pattern, string, flags);
+    Wrapper& wrapper = Wrapper::get();
+    if (wrapper.fold_fnmatch && (flags & (FNM_PATHNAME | FNM_PERIOD))) flags |= FNM_CASEFOLD;
+    return wrapper.fnmatch_real(pattern, string, flags);
+}
+
+int scandir(const char *path, struct dirent ***namelist, int (*filter)(const struct dirent *),
+            int (*compar)(const struct dirent **, const struct dirent **)) {
+    BYPASS(scandir, path, namelist, filter, compar);
+    Wrapper& wrapper = Wrapper::get();
+    return wrapper.wrap_func("scandir", AT_FDCWD, path, Wrapper::READS, [&](const char* path) {
+        return wrapper.list_for_scandir(path, namelist, filter, compar, wrapper.scandir_real);
+    });
+}
+
+int scandir64(const char *path, struct dirent64 ***namelist, int (*filter)(const struct dirent64 *),
+              int (*compar)(const struct dirent64 **, const struct dirent64 **)) {
+    BYPASS(scandir64, path, namelist, filter, compar);
+    Wrapper& wrapper = Wrapper::get();
+    return wrapper.wrap_func("scandir64", AT_FDCWD, path, Wrapper::READS, [&](const char* path) {
+        return wrapper.list_for_scandir(path, namelist, filter, compar, wrapper.scandir64_real);
+    });
+}
+
+int access(const char *path, int mode) {
+    return WRAP(access, AT_FDCWD, false, path, path, mode);
+}
+
+int faccessat(int dirfd, const char *path, int mode, int flags) {
+    return WRAP(faccessat, dirfd, false, path, dirfd, path, mode, flags);
+}
+
+// The directory is changed to as given. Relative paths are then looked up
+// from the new current directory, which is stat'ed again once
+int chdir(const char *path) {
+    BYPASS(chdir, path);
+    Wrapper& wrapper = Wrapper::get();
+    int result = wrapper.chdir_real(path);
+    if (result == 0) wrapper.changed_directory();
+    return result;
+}
+
+int fchdir(int fd) {
+    BYPASS(fchdir, fd);
+    Wrapper& wrapper = Wrapper::get();
+    int result = wrapper.fchdir_real(fd);
+    if (result == 0) wrapper.changed_directory();
+    return result;
+}
+
+DIR *opendir(const char *path) {
+    return WRAP(opendir, AT_FDCWD, false, path, path);
+}
+
+ssize_t readlink(const char *path, char *buf, size_t bufsiz) {
+    return WRAP(readlink, AT_FDCWD, false, path, path, buf, bufsiz);
+}
+
+#pragma GCC visibility pop
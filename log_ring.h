@@ -0,0 +1,87 @@
+// Ring of binary log records for the asynchronous DebugLogger of
+// libinsensitive.so. Each thread appends to a ring of its own and a single
+// consumer at a time drains it, so neither side takes a lock: the producer
+// publishes a record by advancing `head` after writing it, and the consumer
+// frees its space by advancing `tail` after reading it
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class LogRing {
+public:
+    static constexpr size_t capacity = 256 * 1024;
+    // Longer messages are truncated
+    static constexpr size_t max_text = 4096;
+
+    struct Record {
+        uint64_t time;   // nanoseconds since the epoch
+        uint32_t length; // of the text that follows the record
+        uint32_t level;
+    };
+
+    // Set while a thread appends to the ring, which is reused by a later
+    // thread once its owner exits
+    std::atomic<bool> owned{false};
+    // Next ring of the logger, set before the ring is published
+    LogRing* next = nullptr;
+
+    // Append a record, or return false if there is no room for it yet
+    bool push(uint64_t time, int level, const char* text, size_t length) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        size_t size = sizeof(Record) + length;
+        if (capacity - (h - tail.load(std::memory_order_acquire)) < size) return false;
+        Record record{time, static_cast<uint32_t>(length), static_cast<uint32_t>(level)};
+        copy_in(h, &record, sizeof(record));
+        copy_in(h + sizeof(record), text, length);
+        head.store(h + size, std::memory_order_release);
+        return true;
+    }
+
+    // Look at the oldest record without taking it
+    bool front(Record& record) const {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        copy_out(t, &record, sizeof(record));
+        return true;
+    }
+
+    // Take the oldest record, returned by front(), copying its text to `text`
+    void pop(const Record& record, char* text) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        copy_out(t + sizeof(record), text, record.length);
+        tail.store(t + sizeof(record) + record.length, std::memory_order_release);
+    }
+
+    size_t used() const {
+        return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed);
+    }
+
+    // Drop all records, in a child process after fork() where they were
+    // copied from the parent, which writes them out itself
+    void clear() {
+        tail.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+private:
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) char data[capacity];
+
+    void copy_in(uint64_t position, const void* source, size_t size) {
+        size_t offset = position % capacity;
+        size_t first = std::min(size, capacity - offset);
+        memcpy(data + offset, source, first);
+        memcpy(data, static_cast<const char*>(source) + first, size - first);
+    }
+
+    void copy_out(uint64_t position, void* target, size_t size) const {
+        size_t offset = position % capacity;
+        size_t first = std::min(size, capacity - offset);
+        memcpy(target, data + offset, first);
+        memcpy(static_cast<char*>(target) + first, data, size - first);
+    }
+};
@@ -0,0 +1,185 @@
+// Live counters of a build, shared by all processes preloaded with
+// libinsensitive.so in a session through /dev/shm/insensitive-<session>.top
+// and read by insensitive-top. Each process counts into a slot of its own, so
+// that readers never wait for it and it never waits for them. A process that
+// exits adds its counts to the totals of the session and frees its slot
+#pragma once
+
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+class Monitor {
+public:
+    static constexpr uint32_t magic = 0x494e5354; // "INST"
+    static constexpr size_t max_processes = 1024;
+    static constexpr size_t max_paths = 4096;
+    static constexpr size_t max_path_length = 240;
+    static constexpr size_t max_probes = 32;
+
+    struct alignas(64) Process {
+        // 0 for a free slot
+        std::atomic<int32_t> pid;
+        char program[28];
+        std::atomic<uint64_t> start_time; // CLOCK_MONOTONIC, in nanoseconds
+        std::atomic<uint64_t> counters[Stats::COUNTER_COUNT];
+    };
+
+    // A path that was found in another case, with how often it was asked for
+    struct Path {
+        std::atomic<uint64_t> hash;   // 0 for a free slot
+        std::atomic<uint64_t> count;
+        std::atomic<uint32_t> length; // 0 until the path is written
+        char path[max_path_length];
+    };
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        // Counts of the processes that exited
+        std::atomic<uint64_t> exited;
+        std::atomic<uint64_t> totals[Stats::COUNTER_COUNT];
+        Process processes[max_processes];
+        Path paths[max_paths];
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "monitor needs lock-free atomics");
+
+    static constexpr size_t mapping_size = sizeof(Header);
+
+    ~Monitor() {
+        if (header) munmap(header, mapping_size);
+    }
+
+    bool attached() const { return header != nullptr; }
+    const Header* data() const { return header; }
+
+    // Map the session file, which all processes size and initialize the same
+    // way, read-only for a reader
+    bool attach(int fd, bool writable) {
+        if (writable && ftruncate(fd, mapping_size) != 0) return false;
+        int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void* mapping = mmap(nullptr, mapping_size, protection, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) return false;
+
+        Header* h = static_cast<Header*>(mapping);
+        uint32_t expected = 0;
+        if (writable ? !h->magic.compare_exchange_strong(expected, magic) && expected != magic
+                     : h->magic.load(std::memory_order_acquire) != magic) {
+            munmap(mapping, mapping_size);
+            return false;
+        }
+        header = h;
+        return true;
+    }
+
+    // Take a slot for the calling process. A slot left by the process before
+    // exec(), or by one that was killed, is taken over once its counts are
+    // added to the totals
+    bool join(const char* program) {
+        if (!header) return false;
+        int32_t pid = getpid();
+        Process* found = nullptr;
+        for (Process& p : header->processes) {
+            int32_t owner = p.pid.load(std::memory_order_relaxed);
+            if (owner == pid) {
+                found = &p;
+                retire(p);
+                break;
+            }
+        }
+        for (size_t i = 0; !found && i < max_processes; i++) {
+            Process& p = header->processes[i];
+            int32_t owner = p.pid.load(std::memory_order_relaxed);
+            if (owner == 0 && p.pid.compare_exchange_strong(owner, pid, std::memory_order_acquire)) {
+                found = &p;
+            }
+        }
+        for (size_t i = 0; !found && i < max_processes; i++) {
+            Process& p = header->processes[i];
+            int32_t owner = p.pid.load(std::memory_order_relaxed);
+            if (owner != 0 && !alive(owner) && p.pid.compare_exchange_strong(owner, pid, std::memory_order_acquire)) {
+                found = &p;
+                retire(p);
+            }
+        }
+        process = found;
+        if (!process) return false;
+
+        strncpy(process->program, program, sizeof(process->program) - 1);
+        process->program[sizeof(process->program) - 1] = '\0';
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        process->start_time.store(uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec, std::memory_order_release);
+        return true;
+    }
+
+    // Add the counts of the calling process to the totals and free its slot
+    void leave() {
+        if (!process) return;
+        retire(*process);
+        process->pid.store(0, std::memory_order_release);
+        process = nullptr;
+    }
+
+    // The counters of the slot of the calling process, if it has one
+    std::atomic<uint64_t>* counters() { return process ? process->counters : nullptr; }
+
+    // Count a request for a path that exists in another case
+    void count_miscased(std::string_view path) {
+        if (!header) return;
+        uint64_t h = hash(path);
+        for (size_t i = 0; i < max_probes; i++) {
+            Path& slot = header->paths[(h + i) % max_paths];
+            uint64_t slot_hash = slot.hash.load(std::memory_order_acquire);
+            if (slot_hash == 0) {
+                if (!slot.hash.compare_exchange_strong(slot_hash, h, std::memory_order_acq_rel)) {
+                    if (slot_hash != h) continue;
+                } else {
+                    size_t length = std::min(path.size(), sizeof(slot.path));
+                    memcpy(slot.path, path.data(), length);
+                    slot.length.store(length, std::memory_order_release);
+                }
+            } else if (slot_hash != h) {
+                continue;
+            }
+            slot.count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    static bool alive(int32_t pid) {
+        return kill(pid, 0) == 0 || errno != ESRCH;
+    }
+
+private:
+    Header* header = nullptr;
+    Process* process = nullptr;
+
+    void retire(Process& p) {
+        for (int c = 0; c < Stats::COUNTER_COUNT; c++) {
+            uint64_t n = p.counters[c].exchange(0, std::memory_order_relaxed);
+            if (n) header->totals[c].fetch_add(n, std::memory_order_relaxed);
+        }
+        header->exited.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // FNV-1a, never 0 so that it can't be confused with a free slot
+    static uint64_t hash(std::string_view path) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (unsigned char c : path) {
+            h ^= c;
+            h *= 0x100000001b3ull;
+        }
+        return h ? h : 1;
+    }
+};
@@ -0,0 +1,65 @@
+// Static tracepoints of libinsensitive.so for perf, bpftrace and SystemTap,
+// in the format of <sys/sdt.h>: each probe is a nop in the code, which a
+// tracer replaces with a breakpoint while attached, and an ELF note naming it
+// and where its arguments are. Arguments are passed as 8-byte integers
+// or pointers. They are computed even when no tracer is attached, so they
+// should be values at hand. Build with -DINSENSITIVE_NO_PROBES to leave them out
+//
+// bpftrace -l 'usdt:/opt/xwin/lib/libinsensitive.so:*'
+#pragma once
+
+#include <cstdint>
+
+#if !defined(INSENSITIVE_NO_PROBES) && (defined(__x86_64__) || defined(__aarch64__))
+
+// The note of a probe at the nop, with the address of the .stapsdt.base
+// section for tracers to find the nop in a relocated library
+#define INSENSITIVE_PROBE_NOTE(name, args)                                          \
+    "990: nop\n"                                                                    \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                  \
+    ".balign 4\n"                                                                   \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                              \
+    "991: .asciz \"stapsdt\"\n"                                                     \
+    "992: .balign 4\n"                                                              \
+    "993: .8byte 990b\n"                                                            \
+    ".8byte _.stapsdt.base\n"                                                       \
+    ".8byte 0\n"                                                                    \
+    ".asciz \"insensitive\"\n"                                                      \
+    ".asciz \"" #name "\"\n"                                                        \
+    ".asciz \"" args "\"\n"                                                         \
+    "994: .balign 4\n"                                                              \
+    ".popsection\n"                                                                 \
+    ".ifndef _.stapsdt.base\n"                                                      \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"         \
+    ".weak _.stapsdt.base\n"                                                        \
+    ".hidden _.stapsdt.base\n"                                                      \
+    "_.stapsdt.base: .space 1\n"                                                    \
+    ".size _.stapsdt.base, 1\n"                                                     \
+    ".popsection\n"                                                                 \
+    ".endif\n"
+
+#define INSENSITIVE_PROBE_ARG(value) "nor"((uint64_t)(value))
+
+#define INSENSITIVE_PROBE0(name) __asm__ __volatile__(INSENSITIVE_PROBE_NOTE(name, ""))
+#define INSENSITIVE_PROBE1(name, a)                                                 \
+    __asm__ __volatile__(INSENSITIVE_PROBE_NOTE(name, "8@%0") :: INSENSITIVE_PROBE_ARG(a))
+#define INSENSITIVE_PROBE2(name, a, b)                                              \
+    __asm__ __volatile__(INSENSITIVE_PROBE_NOTE(name, "8@%0 8@%1")                  \
+                         :: INSENSITIVE_PROBE_ARG(a), INSENSITIVE_PROBE_ARG(b))
+#define INSENSITIVE_PROBE3(name, a, b, c)                                           \
+    __asm__ __volatile__(INSENSITIVE_PROBE_NOTE(name, "8@%0 8@%1 8@%2")             \
+                         :: INSENSITIVE_PROBE_ARG(a), INSENSITIVE_PROBE_ARG(b), INSENSITIVE_PROBE_ARG(c))
+#define INSENSITIVE_PROBE4(name, a, b, c, d)                                        \
+    __asm__ __volatile__(INSENSITIVE_PROBE_NOTE(name, "8@%0 8@%1 8@%2 8@%3")        \
+                         :: INSENSITIVE_PROBE_ARG(a), INSENSITIVE_PROBE_ARG(b),     \
+                            INSENSITIVE_PROBE_ARG(c), INSENSITIVE_PROBE_ARG(d))
+
+#else
+
+#define INSENSITIVE_PROBE0(name) do {} while (0)
+#define INSENSITIVE_PROBE1(name, a) do {} while (0)
+#define INSENSITIVE_PROBE2(name, a, b) do {} while (0)
+#define INSENSITIVE_PROBE3(name, a, b, c) do {} while (0)
+#define INSENSITIVE_PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif
@@ -0,0 +1,365 @@
+// Counters and latency histograms of libinsensitive.so, kept per intercepted
+// function when INSENSITIVE_STATS names a directory for reports. Each thread
+// counts into a block of its own, so that counting is a plain store to memory
+// that no other thread writes, and a report sums the blocks of all threads.
+// Reports are written without allocating or taking locks, so that they can
+// also be written from a signal handler
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <pthread.h>
+#include <unistd.h>
+
+class Stats {
+public:
+    enum Counter {
+        CALLS,
+        EXACT_HITS,      // the path existed as given
+        CACHE_HITS,      // resolved from the caches of this process or of the session
+        INDEX_HITS,      // resolved from the prebuilt index
+        NEGATIVE_HITS,   // known not to exist in any case
+        RESOLVED,        // resolved component by component
+        UNRESOLVED,      // resolved component by component, without a match
+        DIR_SCANS,
+        ENTRIES_SCANNED,
+        RESOLVE_NS,      // spent resolving paths, including all of the above
+        CALL_NS,         // spent in intercepted calls, including the real call
+        COUNTER_COUNT
+    };
+
+    static constexpr size_t max_functions = 64;
+
+    // Latency buckets with a relative error of 1/8: exact below 16 ns, then
+    // 8 sub-buckets per power of two, up to about 18 minutes
+    static constexpr int sub_buckets = 8;
+    static constexpr int max_exponent = 40;
+    static constexpr size_t bucket_count = 16 + (max_exponent - 3) * sub_buckets;
+
+    static size_t bucket_of(uint64_t ns) {
+        if (ns < 16) return ns;
+        int exponent = 63 - __builtin_clzll(ns);
+        if (exponent > max_exponent) return bucket_count - 1;
+        return 16 + (exponent - 4) * sub_buckets + ((ns >> (exponent - 3)) & (sub_buckets - 1));
+    }
+
+    static uint64_t bucket_lower_bound(size_t bucket) {
+        if (bucket < 16) return bucket;
+        int exponent = (bucket - 16) / sub_buckets + 4;
+        return (uint64_t(sub_buckets) + (bucket - 16) % sub_buckets) << (exponent - 3);
+    }
+
+    struct FunctionStats {
+        std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+        std::atomic<uint64_t> latency[bucket_count] = {};
+    };
+
+    // Counts the calls of one intercepted function, from its entry to its
+    // return, and what is counted meanwhile on the thread
+    class Scope {
+    public:
+        Scope(Stats& stats, const char* function) : stats(stats) {
+            if (!stats.enabled) return;
+            previous = current;
+            current = stats.function_stats(function);
+            start = now();
+        }
+
+        ~Scope() {
+            if (!stats.enabled) return;
+            uint64_t elapsed = now() - start;
+            if (current) {
+                add(current->counters[CALLS], 1);
+                add(current->counters[CALL_NS], elapsed);
+                add(current->latency[bucket_of(elapsed)], 1);
+            }
+            if (std::atomic<uint64_t>* shared = stats.shared.load(std::memory_order_relaxed)) {
+                shared[CALLS].fetch_add(1, std::memory_order_relaxed);
+                shared[CALL_NS].fetch_add(elapsed, std::memory_order_relaxed);
+            }
+            current = previous;
+        }
+
+    private:
+        Stats& stats;
+        FunctionStats* previous = nullptr;
+        uint64_t start = 0;
+    };
+
+    // Adds the time until the end of its scope to a counter of the current function
+    class Timer {
+    public:
+        Timer(Stats& stats, Counter counter) : stats(stats), counter(counter) {
+            if (stats.enabled) start = now();
+        }
+
+        ~Timer() {
+            if (start) stats.count(counter, now() - start);
+        }
+
+    private:
+        Stats& stats;
+        Counter counter;
+        uint64_t start = 0;
+    };
+
+    bool enabled = false;
+
+    void enable() {
+        enabled = true;
+        start_time = now();
+        pthread_key_create(&thread_key, release_thread);
+    }
+
+    // Also add all counts to `counters`, which other processes read, or stop
+    // adding them with nullptr
+    void publish(std::atomic<uint64_t>* counters) {
+        shared.store(counters, std::memory_order_relaxed);
+    }
+
+    // Count an event for the function the thread is in
+    void count(Counter counter, uint64_t n = 1) {
+        if (!enabled) return;
+        if (current) add(current->counters[counter], n);
+        if (std::atomic<uint64_t>* counters = shared.load(std::memory_order_relaxed)) {
+            counters[counter].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    // Start counting from zero in a child process after fork(), where only
+    // the calling thread runs and the counts copied belong to the parent
+    void reset_after_fork() {
+        start_time = now();
+        for (ThreadStats* thread = threads.load(std::memory_order_relaxed); thread; thread = thread->next) {
+            if (thread != this_thread_stats) thread->owned.store(false, std::memory_order_relaxed);
+            for (auto& function : thread->functions) {
+                FunctionStats* f = function.load(std::memory_order_relaxed);
+                if (!f) continue;
+                for (auto& c : f->counters) c.store(0, std::memory_order_relaxed);
+                for (auto& b : f->latency) b.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Write the report of the process as JSON to `fd`
+    void write_report(int fd, const char* program, pid_t pid) {
+        Writer out{fd, {}};
+        out.put("{\n  \"program\": ");
+        out.put_string(program);
+        out.put(",\n  \"pid\": ");
+        out.put_number(pid);
+        out.put(",\n  \"elapsed_ns\": ");
+        out.put_number(now() - start_time);
+        out.put(",\n  \"functions\": {");
+
+        bool first = true;
+        for (size_t i = 0; i < max_functions; i++) {
+            const char* name = names[i].load(std::memory_order_acquire);
+            if (!name || !first_slot_named(i, name)) continue;
+            FunctionStats total;
+            bool called = false;
+            for (size_t j = i; j < max_functions; j++) {
+                const char* other = names[j].load(std::memory_order_acquire);
+                if (other && strcmp(other, name) == 0) called = sum(j, total) || called;
+            }
+            if (!called) continue;
+
+            out.put(first ? "\n    " : ",\n    ");
+            first = false;
+            out.put_string(name);
+            out.put(": {");
+            for (int c = 0; c < COUNTER_COUNT; c++) {
+                out.put(c == 0 ? "\"" : ", \"");
+                out.put(counter_names[c]);
+                out.put("\": ");
+                out.put_number(total.counters[c].load(std::memory_order_relaxed));
+            }
+            out.put(", \"latency_ns\": [");
+            bool first_bucket = true;
+            for (size_t b = 0; b < bucket_count; b++) {
+                uint64_t n = total.latency[b].load(std::memory_order_relaxed);
+                if (!n) continue;
+                out.put(first_bucket ? "[" : ", [");
+                first_bucket = false;
+                out.put_number(bucket_lower_bound(b));
+                out.put(", ");
+                out.put_number(n);
+                out.put("]");
+            }
+            out.put("]}");
+        }
+        out.put("\n  }\n}\n");
+        out.flush();
+    }
+
+private:
+    static constexpr const char* counter_names[COUNTER_COUNT] = {
+        "calls", "exact_hits", "cache_hits", "index_hits", "negative_hits", "resolved", "unresolved",
+        "dir_scans", "entries_scanned", "resolve_ns", "call_ns"
+    };
+
+    struct ThreadStats {
+        std::atomic<FunctionStats*> functions[max_functions] = {};
+        // Set while a thread counts into the block, which is reused by a
+        // later thread once its owner exits, adding to the same sums
+        std::atomic<bool> owned{false};
+        ThreadStats* next = nullptr;
+    };
+
+    // Names of the functions by slot. The names are string literals, so a
+    // slot is found by address, and the slots of a function whose name
+    // appears at several addresses are merged in reports
+    std::atomic<const char*> names[max_functions] = {};
+    std::atomic<ThreadStats*> threads{nullptr};
+    std::atomic<std::atomic<uint64_t>*> shared{nullptr};
+    pthread_key_t thread_key;
+    uint64_t start_time = 0;
+
+    static inline thread_local ThreadStats* this_thread_stats = nullptr;
+    static inline thread_local FunctionStats* current = nullptr;
+
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    // Only the owning thread writes a block
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static void release_thread(void* thread) {
+        static_cast<ThreadStats*>(thread)->owned.store(false, std::memory_order_release);
+    }
+
+    int slot_of(const char* name) {
+        size_t start = (reinterpret_cast<uintptr_t>(name) >> 3) % max_functions;
+        for (size_t probe = 0; probe < max_functions; probe++) {
+            size_t i = (start + probe) % max_functions;
+            const char* found = names[i].load(std::memory_order_acquire);
+            if (found == name) return i;
+            if (!found && names[i].compare_exchange_strong(found, name, std::memory_order_acq_rel)) return i;
+            if (found == name) return i; // claimed by another thread meanwhile
+        }
+        return -1;
+    }
+
+    ThreadStats* thread_stats() {
+        if (this_thread_stats) return this_thread_stats;
+        for (ThreadStats* thread = threads.load(std::memory_order_acquire); thread; thread = thread->next) {
+            bool expected = false;
+            if (thread->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                this_thread_stats = thread;
+                break;
+            }
+        }
+        if (!this_thread_stats) {
+            ThreadStats* thread = new (std::nothrow) ThreadStats;
+            if (!thread) return nullptr;
+            thread->owned.store(true, std::memory_order_relaxed);
+            thread->next = threads.load(std::memory_order_relaxed);
+            while (!threads.compare_exchange_weak(thread->next, thread, std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+            }
+            this_thread_stats = thread;
+        }
+        pthread_setspecific(thread_key, this_thread_stats);
+        return this_thread_stats;
+    }
+
+    FunctionStats* function_stats(const char* function) {
+        int slot = slot_of(function);
+        ThreadStats* thread = slot >= 0 ? thread_stats() : nullptr;
+        if (!thread) return nullptr;
+        FunctionStats* f = thread->functions[slot].load(std::memory_order_relaxed);
+        if (!f) {
+            f = new (std::nothrow) FunctionStats;
+            thread->functions[slot].store(f, std::memory_order_release);
+        }
+        return f;
+    }
+
+    bool first_slot_named(size_t slot, const char* name) {
+        for (size_t i = 0; i < slot; i++) {
+            const char* other = names[i].load(std::memory_order_acquire);
+            if (other && strcmp(other, name) == 0) return false;
+        }
+        return true;
+    }
+
+    // Add the blocks of all threads for a slot, false if it was never called
+    bool sum(size_t slot, FunctionStats& total) {
+        bool called = false;
+        for (ThreadStats* thread = threads.load(std::memory_order_acquire); thread; thread = thread->next) {
+            FunctionStats* f = thread->functions[slot].load(std::memory_order_acquire);
+            if (!f) continue;
+            called = true;
+            for (int c = 0; c < COUNTER_COUNT; c++) add(total.counters[c], f->counters[c].load(std::memory_order_relaxed));
+            for (size_t b = 0; b < bucket_count; b++) add(total.latency[b], f->latency[b].load(std::memory_order_relaxed));
+        }
+        return called;
+    }
+
+    // Buffered output to a file descriptor with write() only
+    struct Writer {
+        int fd;
+        char buffer[4096];
+        size_t size = 0;
+
+        void put(const char* s, size_t n) {
+            while (n) {
+                if (size == sizeof(buffer)) flush();
+                size_t chunk = std::min(n, sizeof(buffer) - size);
+                memcpy(buffer + size, s, chunk);
+                size += chunk;
+                s += chunk;
+                n -= chunk;
+            }
+        }
+
+        void put(const char* s) { put(s, strlen(s)); }
+
+        void put_number(uint64_t value) {
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value);
+            put(digits, result.ptr - digits);
+        }
+
+        void put_string(const char* s) {
+            put("\"");
+            for (; *s; s++) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\') {
+                    char escaped[2] = {'\\', static_cast<char>(c)};
+                    put(escaped, 2);
+                } else if (c < 0x20) {
+                    char escaped[7] = "\\u0000";
+                    escaped[4] = "0123456789abcdef"[c >> 4];
+                    escaped[5] = "0123456789abcdef"[c & 15];
+                    put(escaped, 6);
+                } else {
+                    put(s, 1);
+                }
+            }
+            put("\"");
+        }
+
+        void flush() {
+            for (size_t written = 0; written < size;) {
+                ssize_t n = write(fd, buffer + written, size - written);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                written += n;
+            }
+            size = 0;
+        }
+    };
+};
@@ -0,0 +1,27 @@
+# Helpers of the tests run by tests/run.sh, which stop a test at its first
+# failed command
+set -e
+
+# Run the probe with the library preloaded
+probe() {
+    LD_PRELOAD="$LIBRARY" "$PROBE" "$@"
+}
+
+# Compare the output of a command, one result per line, with what is expected
+expect() {
+    local expected=$1
+    shift
+    local actual
+    actual=$("$@")
+    if [ "$actual" != "$expected" ]; then
+        echo "$*:"
+        echo "  expected: $(echo "$expected" | paste -sd '|')"
+        echo "  actual:   $(echo "$actual" | paste -sd '|')"
+        return 1
+    fi
+}
+
+skip() {
+    echo "$1"
+    exit 77
+}
@@ -0,0 +1,107 @@
+// Make a sequence of libc calls in one process and print the result of each
+// on a line, for the tests to compare with what they expect. Run with the
+// library preloaded, so that the calls share its caches:
+//
+// clang++ -O2 -std=c++20 tests/probe.cpp -o probe
+// LD_PRELOAD=./libinsensitive.so ./probe <call> <arguments>... [<call> <arguments>...]...
+//
+// Calls:
+//   stat <path>                 "file", "dir" or the error
+//   lstat <path>                "file", "dir", "link" or the error
+//   readlink <path>             the target or the error
+//   open <path>                 "ok" or the error
+//   creat <path>                "ok" or the error
+//   mkdir <path>                "ok" or the error
+//   chdir <path>                "ok" or the error
+//   rename <path> <new path>    "ok" or the error
+//   link <path> <new path>      "ok" or the error
+//   symlink <target> <path>     "ok" or the error
+//   setmtime <path> <seconds>.<nanoseconds>
+//                               "ok" or the error, after setting the mtime
+//   glob <pattern>              the matches separated by spaces, or "nomatch"
+//   fnmatch <pattern> <string>  "match" or "nomatch", with FNM_PATHNAME
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* kind(const struct stat& st) {
+    return S_ISLNK(st.st_mode) ? "link" : S_ISDIR(st.st_mode) ? "dir" : "file";
+}
+
+static void print_result(int result) {
+    puts(result == 0 ? "ok" : strerror(errno));
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ) {
+        std::string call = argv[i++];
+        auto argument = [&]() -> const char* {
+            if (i >= argc) {
+                fprintf(stderr, "probe: %s needs more arguments\n", call.c_str());
+                exit(EXIT_FAILURE);
+            }
+            return argv[i++];
+        };
+        struct stat st;
+        if (call == "stat") {
+            puts(stat(argument(), &st) == 0 ? kind(st) : strerror(errno));
+        } else if (call == "lstat") {
+            puts(lstat(argument(), &st) == 0 ? kind(st) : strerror(errno));
+        } else if (call == "readlink") {
+            char target[PATH_MAX];
+            ssize_t length = readlink(argument(), target, sizeof(target) - 1);
+            if (length >= 0) target[length] = '\0';
+            puts(length >= 0 ? target : strerror(errno));
+        } else if (call == "open") {
+            int fd = open(argument(), O_RDONLY);
+            print_result(fd >= 0 ? close(fd) : -1);
+        } else if (call == "creat") {
+            int fd = creat(argument(), 0644);
+            print_result(fd >= 0 ? close(fd) : -1);
+        } else if (call == "mkdir") {
+            print_result(mkdir(argument(), 0755));
+        } else if (call == "chdir") {
+            print_result(chdir(argument()));
+        } else if (call == "rename") {
+            const char* from = argument();
+            print_result(rename(from, argument()));
+        } else if (call == "link") {
+            const char* from = argument();
+            print_result(link(from, argument()));
+        } else if (call == "symlink") {
+            const char* target = argument();
+            print_result(symlink(target, argument()));
+        } else if (call == "setmtime") {
+            const char* file = argument();
+            struct timespec times[2] = {{0, UTIME_OMIT}, {0, 0}};
+            sscanf(argument(), "%ld.%ld", &times[1].tv_sec, &times[1].tv_nsec);
+            print_result(utimensat(AT_FDCWD, file, times, 0));
+        } else if (call == "glob") {
+            glob_t g;
+            int result = glob(argument(), 0, nullptr, &g);
+            if (result == 0) {
+                for (size_t j = 0; j < g.gl_pathc; j++) printf("%s%s", j ? " " : "", g.gl_pathv[j]);
+                putchar('\n');
+                globfree(&g);
+            } else {
+                puts(result == GLOB_NOMATCH ? "nomatch" : "error");
+            }
+        } else if (call == "fnmatch") {
+            const char* pattern = argument();
+            puts(fnmatch(pattern, argument(), FNM_PATHNAME) == 0 ? "match" : "nomatch");
+        } else {
+            fprintf(stderr, "probe: unknown call %s\n", call.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Build the library, insensitive-index and tests/probe.cpp from this checkout
+# and run every tests/*.test script with them. A test gets the paths of what
+# was built and a scratch directory in its environment:
+#
+#   LIBRARY   libinsensitive.so, built like the Dockerfile builds it
+#   INDEX     insensitive-index
+#   PROBE     tests/probe.cpp, which makes libc calls and prints their results
+#   SCRATCH   an empty directory, removed afterwards
+#
+# and fails by exiting with a non-zero status, or skips itself by exiting
+# with 77. tests/lib.sh has the helpers they share.
+#
+# tests/run.sh [test...]
+#
+# CXX selects the compiler, clang++ by default.
+set -e
+
+repo=$(cd "$(dirname "$0")/.." && pwd)
+CXX=${CXX:-clang++}
+
+work=$(mktemp -d /tmp/insensitive-tests-XXXXXX)
+trap 'rm -rf "$work"' EXIT
+
+# The flags of the Dockerfile, with logging kept for the failures
+runtime=(-fno-exceptions -fno-rtti -static-libstdc++ -static-libgcc -Wl,--exclude-libs,ALL
+         -fvisibility=hidden -fvisibility-inlines-hidden -Wl,--version-script="$repo/insensitive.map")
+$CXX -O2 -std=c++20 -fPIC "${runtime[@]}" "$repo/insensitive.cpp" -shared -o "$work/libinsensitive.so"
+$CXX -O2 -std=c++20 "$repo/insensitive-index.cpp" -o "$work/insensitive-index"
+$CXX -O2 -std=c++20 "$repo/tests/probe.cpp" -o "$work/probe"
+
+tests=("$@")
+[ ${#tests[@]} -gt 0 ] || tests=("$repo"/tests/*.test)
+
+passed=0 failed=0 skipped=0
+for test in "${tests[@]}"; do
+    name=$(basename "$test" .test)
+    scratch="$work/scratch-$name"
+    mkdir "$scratch"
+    status=0
+    # Only the settings of each test apply, not those of the environment
+    env -u LD_PRELOAD -u INSENSITIVE_SESSION -u INSENSITIVE_STATS -u INSENSITIVE_RECORD -u INSENSITIVE_DEBUG \
+        -u INSENSITIVE_ROOTS -u INSENSITIVE_EXCLUDE -u INSENSITIVE_OPTIMISTIC -u INSENSITIVE_PROCESSES \
+        -u INSENSITIVE_FNMATCH INSENSITIVE_INDEX= LIBRARY="$work/libinsensitive.so" INDEX="$work/insensitive-index" \
+        PROBE="$work/probe" SCRATCH="$scratch" bash "$test" > "$work/$name.log" 2>&1 || status=$?
+    case $status in
+        0) echo "PASS $name"; passed=$((passed + 1)) ;;
+        77) echo "SKIP $name: $(tail -n 1 "$work/$name.log")"; skipped=$((skipped + 1)) ;;
+        *) echo "FAIL $name"; sed 's/^/    /' "$work/$name.log"; failed=$((failed + 1)) ;;
+    esac
+done
+echo "$passed passed, $failed failed, $skipped skipped"
+[ $failed -eq 0 ]
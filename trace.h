@@ -0,0 +1,85 @@
+// Trace of the calls intercepted by libinsensitive.so, appended to the file
+// named by INSENSITIVE_RECORD by every preloaded process, and replayed by
+// insensitive-replay. Each record is written with a single write() to a file
+// opened with O_APPEND, so the records of concurrent processes and threads
+// don't interleave, and none are lost when a process calls exec() or _exit().
+//
+// Layout:
+//   char magic[8]
+//   records, each a TraceRecord followed by the function name, the path, the
+//   adjusted path and the base directory, without terminators
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+struct TraceRecord {
+    static constexpr char magic[8] = "INSTRC1";
+
+    // Flags of a record
+    static constexpr uint8_t LOOKED_UP = 1;     // the path was looked up
+    static constexpr uint8_t KNOWN_MISSING = 2; // after the call failed, without checking the exact path
+    static constexpr uint8_t CREATES = 4;       // the call may create the path
+    static constexpr uint8_t REMOVES = 8;       // the call removes or renames the path
+    static constexpr uint8_t FAILED = 16;       // the call failed, with `error`
+    static constexpr uint8_t DIRFD = 32;        // a relative path was relative to a dirfd, not the cwd
+
+    uint32_t size; // of the record and its strings
+    uint32_t pid;
+    uint8_t flags;
+    uint8_t function_length;
+    uint16_t error;
+    uint16_t path_length;
+    uint16_t adjusted_length; // 0 if the call used the path as given
+    uint16_t base_length;     // directory of a relative path, 0 for an absolute one
+    uint16_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 20, "trace records are written as they are laid out");
+
+// A record with its strings
+struct TraceEntry {
+    TraceRecord record;
+    std::string_view function;
+    std::string_view path;
+    std::string_view adjusted;
+    std::string_view base;
+};
+
+// Records of a trace image, which must outlive the reader
+class TraceReader {
+public:
+    bool attach(const void* data, size_t size) {
+        if (size < sizeof(TraceRecord::magic) || memcmp(data, TraceRecord::magic, sizeof(TraceRecord::magic)) != 0) {
+            return false;
+        }
+        begin = static_cast<const char*>(data);
+        position = sizeof(TraceRecord::magic);
+        end = size;
+        return true;
+    }
+
+    // The next record, or false at the end of the trace or at a record cut short
+    bool next(TraceEntry& entry) {
+        TraceRecord& r = entry.record;
+        if (end - position < sizeof(r)) return false;
+        memcpy(&r, begin + position, sizeof(r));
+        size_t length = size_t(r.function_length) + r.path_length + r.adjusted_length + r.base_length;
+        if (r.size != sizeof(r) + length || end - position < r.size) return false;
+
+        const char* strings = begin + position + sizeof(r);
+        entry.function = std::string_view(strings, r.function_length);
+        entry.path = std::string_view(strings += r.function_length, r.path_length);
+        entry.adjusted = std::string_view(strings += r.path_length, r.adjusted_length);
+        entry.base = std::string_view(strings + r.adjusted_length, r.base_length);
+        position += r.size;
+        return true;
+    }
+
+private:
+    const char* begin = nullptr;
+    size_t position = 0;
+    size_t end = 0;
+};